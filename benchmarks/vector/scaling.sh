@@ -0,0 +1,15 @@
+#!/bin/sh
+# runs scaling.R with 1, 2, 4, ... threads up to the number of cores
+# usage: benchmarks/vector/scaling.sh [path to riposte]
+
+RIPOSTE=${1:-./riposte}
+DIR=`dirname $0`
+CORES=`getconf _NPROCESSORS_ONLN`
+
+printf "threads\tshort\tlong\n"
+j=1
+while [ $j -le $CORES ]; do
+	printf "%d\t" $j
+	$RIPOSTE -j$j -f $DIR/scaling.R | grep "^scaling" | cut -f2-
+	j=`expr $j \* 2`
+done
@@ -132,6 +132,7 @@
 	_(length, "length", CountFold) \
 	_(mean, "mean", MomentFold) \
 	_(cm2, "cm2", Moment2Fold) \
+	_(moments, "moments", MomentsFold) \
 
 #define ARITH_SCAN_BYTECODES(_) \
 	_(cumsum, "cumsum",	ArithScan,	add) \
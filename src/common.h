@@ -91,6 +91,14 @@ static inline double time_elapsed(timespec const& begin)
 #endif
 }
 
+// seconds on a clock that only goes forwards, for timing short stretches
+static inline double monotonic_time()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / (double)1000000000;
+}
+
 static inline void print_time (char const* prompt, timespec const& begin, timespec const& end)
 {
 #ifdef TIMING
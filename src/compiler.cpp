@@ -29,6 +29,7 @@ static ByteCode::Enum op1(String const& func) {
 	if(func == Strings::sum) return ByteCode::sum; 
 	if(func == Strings::prod) return ByteCode::prod; 
 	if(func == Strings::mean) return ByteCode::mean; 
+	if(func == Strings::moments) return ByteCode::moments; 
 	if(func == Strings::min) return ByteCode::min; 
 	if(func == Strings::max) return ByteCode::max; 
 	if(func == Strings::any) return ByteCode::any; 
@@ -720,6 +721,7 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		func == Strings::sum ||
 		func == Strings::prod ||
 		func == Strings::mean ||
+		func == Strings::moments ||
 		func == Strings::min ||
 		func == Strings::max ||
 		func == Strings::any ||
@@ -2296,6 +2296,29 @@ void Assembler::movhlps(XMMRegister dst, XMMRegister src) {
 	emit_sse_operand(dst, src);
 }
 
+void Assembler::prefetch(const Operand& src, int level) {
+	assert(is_uint2(level));
+	EnsureSpace ensure_space(this);
+	emit_optional_rex_32(src);
+	emit(0x0F);
+	emit(0x18);
+	emit_operand(level, src);
+}
+
+void Assembler::vgatherqpd(XMMRegister dst, Register base, XMMRegister index, XMMRegister mask) {
+	assert(!dst.is(index) && !dst.is(mask) && !index.is(mask));
+	// base + index*8 without a displacement can't use rbp or r13
+	assert(base.low_bits() != 5);
+	EnsureSpace ensure_space(this);
+	// VEX.128.66.0F38.W1 93 /r
+	emit(0xC4);
+	emit((dst.high_bit() ^ 1) << 7 | (index.high_bit() ^ 1) << 6 | (base.high_bit() ^ 1) << 5 | 0x02);
+	emit(0x80 | (~mask.code() & 0xF) << 3 | 0x01);
+	emit(0x93);
+	emit(dst.low_bits() << 3 | 0x04);
+	emit(times_8 << 6 | index.low_bits() << 3 | base.low_bits());
+}
+
 void Assembler::movaps(XMMRegister dst, XMMRegister src) {
 	EnsureSpace ensure_space(this);
 	if (src.low_bits() == 4) {
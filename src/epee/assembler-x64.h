@@ -679,6 +679,14 @@ class Assembler {
   void movlhps(XMMRegister dst, XMMRegister src);
   void movhlps(XMMRegister dst, XMMRegister src);
 
+  // Hint that the cache line at src will be read soon.
+  // level is 0 (non-temporal), 1 (all levels), 2 (L2 and up) or 3 (L3 and up).
+  void prefetch(const Operand& src, int level);
+
+  // AVX2 gather of two doubles from base + index*8, for the lanes whose mask
+  // sign bit is set. The mask is cleared. dst, index and mask must differ.
+  void vgatherqpd(XMMRegister dst, Register base, XMMRegister index, XMMRegister mask);
+
   // Repeated moves.
 
   void repmovsb();
@@ -47,6 +47,7 @@ struct IRNode {
 		MAP,
 		FILTER,
 		FOLD,
+		SCAN,
 		SPLIT,
 		SCALAR
 	};
@@ -0,0 +1,71 @@
+#ifndef _RIPOSTE_MOMENTS_H
+#define _RIPOSTE_MOMENTS_H
+
+#include <limits>
+#include <cmath>
+
+// Running count, sum, mean, variance, min and max of a vector, for moments().
+// The mean and sum of squared deviations are updated with Welford's method and
+// the sum is compensated (Neumaier's variant of Kahan summation), so long
+// vectors don't lose precision. States of disjoint parts of a vector combine
+// exactly (Chan et al.), so every thread keeps its own and they're merged once.
+struct Moments {
+	enum { N, MEAN, M2, SUM, COMP, MIN, MAX };
+	static const int64_t Width = 8;	// doubles of state, padded to a cache line
+	static const int64_t Stats = 6;	// count, sum, mean, var, min, max
+
+	static void init(double* m) {
+		m[N] = m[MEAN] = m[M2] = m[SUM] = m[COMP] = 0;
+		m[MIN] = std::numeric_limits<double>::infinity();
+		m[MAX] = -std::numeric_limits<double>::infinity();
+		m[7] = 0;
+	}
+
+	static void sum(double* m, double x) {
+		double t = m[SUM] + x;
+		if(std::fabs(m[SUM]) >= std::fabs(x))
+			m[COMP] += (m[SUM] - t) + x;
+		else
+			m[COMP] += (x - t) + m[SUM];
+		m[SUM] = t;
+	}
+
+	// NaNs (and NAs) stick in the min and max, like they do in the other stats
+	static void extremes(double* m, double lo, double hi) {
+		if(lo < m[MIN] || lo != lo) m[MIN] = m[MIN] != m[MIN] ? m[MIN] : lo;
+		if(hi > m[MAX] || hi != hi) m[MAX] = m[MAX] != m[MAX] ? m[MAX] : hi;
+	}
+
+	static void add(double* m, double x) {
+		m[N] += 1;
+		double d = x - m[MEAN];
+		m[MEAN] += d / m[N];
+		m[M2] += d * (x - m[MEAN]);
+		sum(m, x);
+		extremes(m, x, x);
+	}
+
+	static void merge(double* m, double const* o) {
+		if(o[N] == 0)
+			return;
+		double n = m[N] + o[N];
+		double d = o[MEAN] - m[MEAN];
+		m[M2] += o[M2] + d * d * m[N] * o[N] / n;
+		m[MEAN] += d * o[N] / n;
+		m[N] = n;
+		sum(m, o[SUM]);
+		m[COMP] += o[COMP];
+		extremes(m, o[MIN], o[MAX]);
+	}
+
+	static void result(double const* m, double* r) {
+		r[0] = m[N];
+		r[1] = m[SUM] + m[COMP];
+		r[2] = m[N] > 0 ? m[MEAN] : std::numeric_limits<double>::quiet_NaN();
+		r[3] = m[N] > 1 ? m[M2] / (m[N] - 1) : std::numeric_limits<double>::quiet_NaN();
+		r[4] = m[MIN];
+		r[5] = m[MAX];
+	}
+};
+
+#endif
@@ -2,6 +2,8 @@
 #include "../vector.h"
 #include "../ops.h"
 #include "../sse.h"
+#include "../runtime.h"
+#include "moments.h"
 //#include <unordered_set>
 #include <stdlib.h>
 
@@ -10,11 +12,31 @@ void Trace::Reset() {
 	nodes.clear();
 	outputs.clear();
 	liveEnvironments.clear();
+	dependencies.clear();
+	roots.clear();
+	site = 0;
+	source = 0;
+	pc = 0;
+	setup = 0;
+	recorded = 0;
+	spills = 0;
 }
 
 Trace::Trace() { 
 	Reset(); 
 	code_buffer = NULL;
+	launched = NULL;
+}
+
+int64_t DeterministicChunk(int64_t size, int64_t width) {
+	// at least 16 blocks a chunk, more if there'd be too many partials to merge
+	int64_t chunk = 16*TRACE_BLOCK;
+	for(;;) {
+		int64_t n = (size+chunk-1)/chunk;
+		if(n <= 1 || (n <= 256 && n*width <= (1LL << 22)))
+			return chunk;
+		chunk *= 2;
+	}
 }
 
 std::string shape2string(IRNode::Shape const& shape) {
@@ -44,6 +66,7 @@ std::string Trace::toString(Thread & thread) {
 		NULLARY(random)
 		BINARY(mean)
 		TRINARY(cm2)
+		UNARY(moments)
 		UNARY(cast)
 		UNARY(filter)
 		BINARY(split)
@@ -75,6 +98,8 @@ std::string Trace::toString(Thread & thread) {
 						out << "r[" << o.reg << "] "; break;
 					case Trace::Output::MEMORY:
 						out << thread.externStr(o.pointer.name) << " "; break;
+					case Trace::Output::TRACE:
+						out << "n" << o.node << " "; break;
 					}
 				}
 			}
@@ -106,6 +131,11 @@ IRef Trace::EmitUnary(IROpCode::Enum op, Type::Enum type, IRef a, int64_t data)
 		n.group = IRNode::FOLD;
 		n.arity = op == IROpCode::length ? IRNode::NULLARY : IRNode::UNARY;
 		n.outShape = (IRNode::Shape) { nodes[a].outShape.levels, -1, 1, -1, true };
+	} else if(op == IROpCode::moments) {
+		// all the statistics of a group are next to each other
+		n.group = IRNode::FOLD;
+		n.arity = IRNode::UNARY;
+		n.outShape = (IRNode::Shape) { nodes[a].outShape.levels*Moments::Stats, -1, 1, -1, true };
 	} else if(op == IROpCode::mean) {
 		union {
 			double d;
@@ -116,6 +146,12 @@ IRef Trace::EmitUnary(IROpCode::Enum op, Type::Enum type, IRef a, int64_t data)
 		n.group = IRNode::FOLD;
 		n.arity = IRNode::BINARY;
 		n.outShape = (IRNode::Shape) { nodes[a].outShape.levels, -1, 1, -1, true };
+	} else if(	op == IROpCode::cumsum || op == IROpCode::cumprod ||
+			op == IROpCode::cummin || op == IROpCode::cummax) {
+		// scans are only done after the whole trace runs, so nothing can fuse with their result
+		n.group = IRNode::SCAN;
+		n.arity = IRNode::UNARY;
+		n.outShape = (IRNode::Shape) { nodes[a].outShape.length, -1, 1, -1, true };
 	} else {
 		n.group = IRNode::MAP;
 		n.arity = IRNode::UNARY;
@@ -235,8 +271,8 @@ IRef Trace::EmitGenerator(IROpCode::Enum op, Type::Enum type, int64_t length, in
 	return nodes.size()-1;
 }
 
-IRef Trace::EmitRandom(int64_t length) {
-	return EmitGenerator(IROpCode::random, Type::Double, length, 0, 0);
+IRef Trace::EmitRandom(int64_t length, int64_t seed, int64_t stream) {
+	return EmitGenerator(IROpCode::random, Type::Double, length, seed, stream);
 }
 
 IRef Trace::EmitIndex(int64_t length, int64_t a, int64_t b) {
@@ -358,16 +394,22 @@ void Trace::MarkLiveOutputs(Thread& thread) {
 	for(size_t i = 0; i < nodes.size(); i++) {
 		nodes[i].liveOut = false;
 	}
+
+	// outputs handed to the rest of a partially executed trace are already recorded
+	for(size_t i = 0; i < outputs.size(); i++) {
+		nodes[outputs[i].ref].liveOut = true;
+	}
 	
 	for(Value* v = thread.registers;
 		v < thread.frame.registers + thread.frame.prototype->registers; 
 		v++) {
-		if(v->isFuture() && ((Future const&)*v).trace() == this) {
+		if(v->isFuture() && ((Future const&)*v).trace() == this && nodes[((Future const&)*v).ref()].group != IRNode::NOP) {
 			nodes[((Future const&)*v).ref()].liveOut = true;
 			Output o;
 			o.type = Output::REG;
 			o.reg = v;
 			o.ref = ((Future const&)*v).ref();
+			o.future = o.ref;
 			outputs.push_back(o);
 		}
 	}
@@ -375,30 +417,40 @@ void Trace::MarkLiveOutputs(Thread& thread) {
 	for(std::set<Environment*>::const_iterator i = liveEnvironments.begin(); i != liveEnvironments.end(); ++i) {
 		for(Environment::const_iterator j = (*i)->begin(); j != (*i)->end(); ++j) {
 			Value const& v = j.value();
-			if(v.isFuture() && ((Future const&)v).trace() == this) {
+			if(v.isFuture() && ((Future const&)v).trace() == this && nodes[((Future const&)v).ref()].group != IRNode::NOP) {
 				nodes[((Future const&)v).ref()].liveOut = true;
 				Output o;
 				o.type = Output::MEMORY;
 				o.pointer = (*i)->makePointer(j.string());
 				o.ref = ((Future const&)v).ref();
+				o.future = o.ref;
 				outputs.push_back(o);
 			}
 		}
 
 		for(size_t j = 0; j < (*i)->dots.size(); j++) {
 			Value const& v = (*i)->dots[j].v;
-			if(v.isFuture() && ((Future const&)v).trace() == this) {
+			if(v.isFuture() && ((Future const&)v).trace() == this && nodes[((Future const&)v).ref()].group != IRNode::NOP) {
 				nodes[((Future const&)v).ref()].liveOut = true;
 				Output o;
 				o.type = Output::REG;
 				o.reg = (Value*)&v;
 				o.ref = ((Future const&)v).ref();
+				o.future = o.ref;
 				outputs.push_back(o);
 			}
 		}
 	}
 }
 
+// attributes set on a future (e.g. a matrix's dim) stay on its result
+static Value WithAttributes(Value const& future, Value const& result) {
+	Value v = result;
+	if(future.isFuture() && ((Object const&)future).hasAttributes())
+		((Object&)v).attributes(((Object const&)future).attributes());
+	return v;
+}
+
 void Trace::WriteOutputs(Thread & thread) {
 	if(thread.state.verbose) {
 		for(size_t i = 0; i < nodes.size(); i++) {
@@ -415,10 +467,12 @@ void Trace::WriteOutputs(Thread & thread) {
 
 		switch(o.type) {
 		case Output::REG:
-			*o.reg = v;
+			*o.reg = WithAttributes(*o.reg, v);
 			break;
 		case Output::MEMORY:
-			Environment::assignPointer(o.pointer,v);
+			Environment::assignPointer(o.pointer, WithAttributes(Environment::getPointer(o.pointer), v));
+			break;
+		case Output::TRACE:
 			break;
 		}
 	}
@@ -591,16 +645,16 @@ void Trace::AlgebraicSimplification(Thread& thread) {
 
 		if(node.op == IROpCode::addc && nodes[node.binary.a].op == IROpCode::addc) {
 			if(node.isInteger())
-				node.constant.i += nodes[node.binary.b].constant.i;
+				node.constant.i += nodes[node.binary.a].constant.i;
 			else
-				node.constant.d += nodes[node.binary.b].constant.d;
+				node.constant.d += nodes[node.binary.a].constant.d;
 			node.binary.a = nodes[node.binary.a].binary.a;
 		}
 		if(node.op == IROpCode::mulc && nodes[node.binary.a].op == IROpCode::mulc) {
 			if(node.isInteger())
-				nodes[node.binary.b].constant.i *= nodes[nodes[node.binary.a].binary.b].constant.i;
+				node.constant.i *= nodes[node.binary.a].constant.i;
 			else
-				nodes[node.binary.b].constant.d *= nodes[nodes[node.binary.a].binary.b].constant.d;
+				node.constant.d *= nodes[node.binary.a].constant.d;
 			node.binary.a = nodes[node.binary.a].binary.a;
 		}
 
@@ -901,7 +955,18 @@ void Trace::ShapePropogation(Thread& thread) {
 	}
 }
 
+static int64_t Nodes(Trace const& trace) {
+	int64_t n = 0;
+	for(size_t i = 0; i < trace.nodes.size(); i++) {
+		if(trace.nodes[i].group != IRNode::NOP)
+			n++;
+	}
+	return n;
+}
+
 void Trace::Optimize(Thread& thread) {
+	timespec begin = get_time();
+	recorded = Nodes(*this);
 
 	if(thread.state.verbose)
 		printf("executing trace:\n%s\n",toString(thread).c_str());
@@ -918,10 +983,11 @@ void Trace::Optimize(Thread& thread) {
 	AlgebraicSimplification(thread);
 	//CSEElimination(thread);
 
-	// move outputs up...
+	// move outputs up past pos nodes that don't filter...
 	for(size_t i = 0; i < outputs.size(); i++) {
 		IRef& r = outputs[i].ref;
-		while(nodes[r].op == IROpCode::pos) {
+		while(nodes[r].op == IROpCode::pos &&
+			nodes[r].shape == nodes[nodes[r].unary.a].outShape) {
 			nodes[r].liveOut = false;
 			r = nodes[r].unary.a;
 		}
@@ -933,44 +999,420 @@ void Trace::Optimize(Thread& thread) {
 
 	if(thread.state.verbose)
 		printf("optimized:\n%s\n",toString(thread).c_str());
+
+	setup += time_elapsed(begin);
+}
+
+
+// Collects the nodes that node reads, including the nodes its shape depends on.
+static int NodeUses(IRNode const& node, IRef* uses) {
+	int n = 0;
+	switch(node.arity) {
+		case IRNode::TRINARY:
+			uses[n++] = node.trinary.a;
+			uses[n++] = node.trinary.b;
+			uses[n++] = node.trinary.c;
+			break;
+		case IRNode::BINARY:
+			uses[n++] = node.binary.a;
+			uses[n++] = node.binary.b;
+			break;
+		case IRNode::UNARY:
+			uses[n++] = node.unary.a;
+			break;
+		case IRNode::NULLARY:
+			break;
+	}
+	if(node.shape.filter >= 0)
+		uses[n++] = node.shape.filter;
+	if(node.shape.split >= 0)
+		uses[n++] = node.shape.split;
+	return n;
+}
+
+// Generators without inputs are cheaper to recompute than to load.
+static bool Regenerable(IRNode const& node) {
+	return 	node.op == IROpCode::constant || 
+		node.op == IROpCode::seq ||
+		node.op == IROpCode::index ||
+		node.op == IROpCode::load;
 }
 
+// Can the rest of the trace read this node back as a load of its output?
+// Only unfiltered, full length vectors that don't depend on a partial fold qualify.
+static bool Materializable(std::vector<IRNode> const& nodes, IRNode const& node, int64_t size) {
+	if(node.group != IRNode::MAP && node.group != IRNode::GENERATOR)
+		return false;
+	if(node.outShape != (IRNode::Shape) { size, -1, 1, -1, false })
+		return false;
+	IRef uses[5];
+	int n = NodeUses(node, uses);
+	for(int i = 0; i < n; i++) {
+		if(nodes[uses[i]].group == IRNode::FOLD)
+			return false;
+	}
+	return true;
+}
 
 // ref must be evaluated. Other stuff doesn't need to be executed unless it improves performance.
 void Trace::Execute(Thread & thread, IRef ref) {
 	// partition into stuff that we will execute and stuff that we won't
-	/*std::vector<IRNode, traceable_allocator<IRNode> > left;
-
-	for(IRef i = 0; i < nodes.size(); i++) {
+	for(IRef i = 0; i < (IRef)nodes.size(); i++) {
 		nodes[i].liveOut = false;
 	}
 	nodes[ref].liveOut = true;
 	
 	// walk backwards marking everything we'll need
 	UsePropogation(thread);
-	// walk forwards propogating use information down
-	DefPropogation(thread);	
-	
-	for(IRef i = 0; i < nodes.size(); i++) {
-		Node& node = nodes[i];
-		if(!node.live) {
-			// pull out unmarked items and put NOPs in their place
-			// update uses
-			// uses of live variables need to be replaced with a load of the output
-			// but outputs aren't defined yet.
-			// it makes a liveOut
+
+	std::vector<bool> needed(nodes.size(), false);
+	for(IRef i = 0; i < (IRef)nodes.size(); i++) {
+		needed[i] = nodes[i].live;
+	}
+	Partial(thread, needed);
+}
+
+// Picks where to split a trace that has grown too long. Cutting before node c
+// writes out every value of the front that the rest of the trace or a live
+// future reads, and the front spills whatever doesn't fit in the vector registers.
+// Returns the cheapest cut in the back half, preferring later cuts, or -1 if
+// every cut there would have to hand over a value that can't be loaded back.
+IRef Trace::Cut(Thread & thread) {
+	IRef n = (IRef)nodes.size();
+
+	// which values futures outside the trace still refer to
+	size_t recorded = outputs.size();
+	MarkLiveOutputs(thread);
+	outputs.resize(recorded);
+
+	// values are live from their definition to their last use, or to the end if a future refers to them
+	std::vector<IRef> last(n, -1);
+	for(IRef i = 0; i < n; i++) {
+		if(nodes[i].liveOut)
+			last[i] = n;
+		IRef uses[5];
+		int k = NodeUses(nodes[i], uses);
+		for(int j = 0; j < k; j++)
+			last[uses[j]] = std::max(last[uses[j]], i);
+	}
+
+	// running counts of live, written out and unloadable values at each cut
+	std::vector<int64_t> live(n+2, 0), written(n+2, 0), blocked(n+2, 0);
+	for(IRef i = 0; i < n; i++) {
+		IRNode const& node = nodes[i];
+		if(node.group == IRNode::NOP || last[i] <= i)
+			continue;
+		live[i+1]++; live[last[i]+1]--;
+		if(!Regenerable(node)) {
+			bool loadable = Materializable(nodes, node, Size);
+			written[i+1]++; written[last[i]+1]--;
+			if(!loadable) { blocked[i+1]++; blocked[last[i]+1]--; }
+		}
+	}
+
+	IRef best = -1;
+	int64_t bestCost = 0, pressure = 0;
+	for(IRef c = 1; c <= n; c++) {
+		live[c] += live[c-1];
+		written[c] += written[c-1];
+		blocked[c] += blocked[c-1];
+		pressure = std::max(pressure, live[c]);
+		int64_t cost = written[c] + std::max(pressure - TRACE_MAX_VECTOR_REGISTERS, (int64_t)0);
+		if(c >= n/2 && blocked[c] == 0 && (best < 0 || cost <= bestCost)) {
+			best = c;
+			bestCost = cost;
+		}
+	}
+
+	if(thread.state.verbose && best >= 0)
+		printf("splitting trace of %d nodes before node %d (%lld values written out, %lld live at most)\n",
+			(int)n, (int)best, (long long)written[best], (long long)pressure);
+	return best;
+}
+
+// Runs the nodes before cut and keeps recording on the rest.
+void Trace::Split(Thread & thread, IRef cut) {
+	std::vector<bool> needed(nodes.size(), false);
+	for(IRef i = 0; i < cut; i++) {
+		needed[i] = true;
+	}
+	Partial(thread, needed);
+	if(nodes.size() == 0)
+		return;
+
+	// what's left of the front is only kept for the rest of the trace to read
+	std::vector<bool> used(cut, false);
+	for(IRef i = cut; i < (IRef)nodes.size(); i++) {
+		IRef uses[5];
+		int n = NodeUses(nodes[i], uses);
+		for(int j = 0; j < n; j++) {
+			if(uses[j] < cut)
+				used[uses[j]] = true;
+		}
+	}
+	for(IRef i = 0; i < cut; i++) {
+		if(!used[i]) {
+			nodes[i].op = IROpCode::nop;
+			nodes[i].arity = IRNode::NULLARY;
+			nodes[i].group = IRNode::NOP;
+		}
+	}
+	Compact(thread);
+}
+
+// Executes the needed nodes. Needed nodes that the rest of the trace uses are handed over through their outputs.
+void Trace::Partial(Thread & thread, std::vector<bool> const& needed) {
+	std::vector<bool> handoff(nodes.size(), false);
+	bool partial = false;
+	for(IRef i = 0; i < (IRef)nodes.size(); i++) {
+		IRNode const& node = nodes[i];
+		if(needed[i] || node.group == IRNode::NOP)
+			continue;
+		partial = true;
+		IRef uses[5];
+		int n = NodeUses(node, uses);
+		for(int j = 0; j < n; j++) {
+			IRNode const& use = nodes[uses[j]];
+			if(needed[uses[j]] && !Regenerable(use)) {
+				// can't cut here, just run everything
+				if(!Materializable(nodes, use, Size)) {
+					Execute(thread);
+					return;
+				}
+				handoff[uses[j]] = true;
+			}
+		}
+	}
+
+	if(!partial) {
+		Execute(thread);
+		return;
+	}
+
+	// pull out unneeded nodes and put NOPs in their place.
+	// Node numbering is unchanged so outstanding futures stay valid.
+	std::vector<IRNode> left(nodes);
+	for(IRef i = 0; i < (IRef)nodes.size(); i++) {
+		if(!needed[i]) {
+			nodes[i].op = IROpCode::nop;
+			nodes[i].arity = IRNode::NULLARY;
+			nodes[i].group = IRNode::NOP;
+		}
+		if(handoff[i]) {
+			Output o;
+			o.type = Output::TRACE;
+			o.node = i;
+			o.ref = i;
+			o.future = i;
+			outputs.push_back(o);
 		}
 	}
 
 	Optimize(thread);
-	JIT(thread);
-	WriteOutputs(thread);
+	if(outputs.size() > 0) {
+		Run(thread);
+		WriteOutputs(thread);
+	}
+
+	// uses of executed nodes are replaced with a load of the output
+	for(size_t i = 0; i < outputs.size(); i++) {
+		Output const& o = outputs[i];
+		if(o.type == Output::TRACE) {
+			IRNode& node = left[o.node];
+			node.op = IROpCode::load;
+			node.arity = IRNode::NULLARY;
+			node.group = IRNode::GENERATOR;
+			node.shape = (IRNode::Shape) { Size, -1, 1, -1, false };
+			node.outShape = node.shape;
+			node.constant.i = 0;
+			node.in = nodes[o.ref].out;
+		}
+	}
+	// everything else we executed has either been written out or is dead
+	for(IRef i = 0; i < (IRef)left.size(); i++) {
+		if(needed[i] && !handoff[i] && !Regenerable(left[i])) {
+			left[i].op = IROpCode::nop;
+			left[i].arity = IRNode::NULLARY;
+			left[i].group = IRNode::NOP;
+		}
+	}
 	
 	n_recorded_since_last_exec = 0;
 	nodes.swap(left);
-	outputs.clear();*/
+	outputs.clear();
+}
 
-	Execute(thread);
+static void Rename(Trace* trace, Value& v, std::vector<IRef> const& renamed) {
+	if(v.isFuture() && ((Future const&)v).trace() == trace) {
+		IRef ref = renamed[((Future const&)v).ref()];
+		assert(ref >= 0);
+		Dictionary* attributes = ((Object const&)v).attributes();
+		Future::Init(v, trace, ref);
+		((Object&)v).attributes(attributes);
+	}
+}
+
+// Drops the NOPs a partial execution leaves behind and renumbers the rest of
+// the trace, so it can keep growing. Futures that refer to it are renamed in
+// the same places MarkLiveOutputs finds them.
+void Trace::Compact(Thread & thread) {
+	std::vector<IRef> renamed(nodes.size(), -1);
+	std::vector<IRNode> kept;
+	for(IRef i = 0; i < (IRef)nodes.size(); i++) {
+		IRNode node = nodes[i];
+		if(node.group == IRNode::NOP)
+			continue;
+		switch(node.arity) {
+			case IRNode::TRINARY:
+				node.trinary.a = renamed[node.trinary.a];
+				node.trinary.b = renamed[node.trinary.b];
+				node.trinary.c = renamed[node.trinary.c];
+				break;
+			case IRNode::BINARY:
+				node.binary.a = renamed[node.binary.a];
+				node.binary.b = renamed[node.binary.b];
+				break;
+			case IRNode::UNARY:
+				node.unary.a = renamed[node.unary.a];
+				break;
+			case IRNode::NULLARY:
+				break;
+		}
+		if(node.shape.filter >= 0) node.shape.filter = renamed[node.shape.filter];
+		if(node.shape.split >= 0) node.shape.split = renamed[node.shape.split];
+		if(node.outShape.filter >= 0) node.outShape.filter = renamed[node.outShape.filter];
+		if(node.outShape.split >= 0) node.outShape.split = renamed[node.outShape.split];
+		renamed[i] = (IRef)kept.size();
+		kept.push_back(node);
+	}
+	nodes.swap(kept);
+
+	for(Value* v = thread.registers;
+		v < thread.frame.registers + thread.frame.prototype->registers; 
+		v++) {
+		Rename(this, *v, renamed);
+	}
+
+	for(std::set<Environment*>::const_iterator i = liveEnvironments.begin(); i != liveEnvironments.end(); ++i) {
+		std::vector<Environment::Pointer> pointers;
+		for(Environment::const_iterator j = (*i)->begin(); j != (*i)->end(); ++j) {
+			Value const& v = j.value();
+			if(v.isFuture() && ((Future const&)v).trace() == this)
+				pointers.push_back((*i)->makePointer(j.string()));
+		}
+		for(size_t j = 0; j < pointers.size(); j++) {
+			Value v = Environment::getPointer(pointers[j]);
+			Rename(this, v, renamed);
+			Environment::assignPointer(pointers[j], v);
+		}
+
+		for(size_t j = 0; j < (*i)->dots.size(); j++) {
+			Rename(this, (*i)->dots[j].v, renamed);
+		}
+	}
+}
+
+void Trace::Run(Thread & thread) {
+	timespec begin = get_time();
+	double optimized = setup;
+	if(thread.state.epeeCompile)
+		JIT(thread);
+	else
+		Interpret(thread);
+	thread.traces.Observe(this, setup, time_elapsed(begin) - (setup - optimized));
+	setup = 0;
+}
+
+static double Average(double average, double x) {
+	return average == 0 ? x : 0.75*average + 0.25*x;
+}
+
+void Traces::Observe(Trace const* trace, double setup, double run) {
+	Tally(trace, setup, run);
+	int64_t nodes = Nodes(*trace);
+	if(nodes == 0)
+		return;
+	traced = Average(traced, run / ((double)nodes * trace->Size));
+	if(trace->site != 0) {
+		TraceSite& s = sites[trace->site];
+		s.setup = Average(s.setup, setup);
+		s.nodes = Average(s.nodes, nodes);
+	}
+}
+
+void Traces::Tally(Trace const* trace, double setup, double run) {
+	TraceSite& s = sites[trace->site];
+	s.source = trace->source;
+	s.pc = trace->pc;
+	s.traces++;
+	s.recorded += trace->recorded;
+	s.optimized += Nodes(*trace);
+	s.compile += setup;
+	s.execute += run;
+	s.elements += trace->Size;
+	s.spills += trace->spills;
+	for(size_t i = 0; i < trace->nodes.size(); i++) {
+		IRNode const& node = trace->nodes[i];
+		if(node.liveOut)
+			s.bytes += node.outShape.length * (node.type == Type::Logical ? 1 : 8);
+	}
+}
+
+// Seconds per element the interpreter takes to add two vectors right away.
+static double Calibrate(Thread& thread) {
+	Double a = Sequence(1.0, 1.0, 4096), b = Sequence(2.0, 1.0, 4096);
+	Value c;
+	timespec begin = get_time();
+	for(int i = 0; i < 16; i++)
+		Zip2< addVOp<Double,Double> >::eval(thread, a, b, c);
+	return time_elapsed(begin) / (16 * 4096);
+}
+
+// Remember the instruction that may start a trace, and where it is for profilers.
+void Traces::Site(Thread& thread, Instruction const& inst) {
+	site = &inst;
+	Prototype const* prototype = thread.frame.prototype;
+	source = prototype->string;
+	pc = &inst - &prototype->bc[0];
+}
+
+// Launching a trace costs at most one more compile, for whatever is recorded
+// on its results later, so it's only worth it if the trace runs longer than that.
+// Until the site has been measured, only clearly long traces are.
+bool Traces::Overlaps(Thread& thread, Trace const* trace) {
+	TraceSite const& s = sites[trace->site];
+	if(traced == 0 || s.setup == 0)
+		return trace->Size >= thread.state.epeeMaxLength;
+	return traced * trace->Size * trace->nodes.size() > s.setup;
+}
+
+// A site records a vector if fusing it saves more than the setup its traces
+// have needed per node. It only switches once the other choice is better by
+// the hysteresis factor, so it doesn't flip back and forth around the break even length.
+bool Traces::isProfitable(Thread& thread, Instruction const& inst, int64_t length) {
+	State const& state = thread.state;
+	if(length >= state.epeeMaxLength)
+		return true;
+	if(length < state.epeeMinLength)
+		return false;
+
+	TraceSite& s = sites[&inst];
+	if(s.nodes == 0 || traced == 0)
+		return s.record;	// nothing measured yet, record to find out
+	if(immediate == 0)
+		immediate = Calibrate(thread);
+
+	double cost = s.setup / s.nodes;
+	double saved = length * (immediate - traced);
+	bool record = s.record;
+	if(s.record && saved * state.epeeHysteresis < cost)
+		s.record = false;
+	else if(!s.record && saved > cost * state.epeeHysteresis)
+		s.record = true;
+	if(state.verbose && record != s.record)
+		printf("%s recording at %p for length %lld (saves %g s, setup %g s per node)\n",
+			s.record ? "started" : "stopped", &inst, (long long)length, saved, cost);
+	return s.record;
 }
 
 // everything must be evaluated in the end...
@@ -978,8 +1420,169 @@ void Trace::Execute(Thread & thread) {
 	Optimize(thread);
 	// if there were any live outputs
 	if(outputs.size() > 0) {
-		JIT(thread);
+		Run(thread);
+		WriteOutputs(thread);
+	}
+	Reset();
+}
+
+// Can the trace run on the other threads while the interpreter goes on?
+// Split and scalar results are only put together by the join.
+bool Trace::Launchable(Thread const& thread) const {
+	if(thread.state.threads.size() < 2 || !thread.state.epeeCompile)
+		return false;
+	for(IRef i = 0; i < (IRef)nodes.size(); i++) {
+		IRNode const& node = nodes[i];
+		if(	node.shape.split >= 0 || 
+			node.group == IRNode::SCALAR)
+			return false;
+	}
+	return true;
+}
+
+// Start running the whole trace on the other threads without waiting for it.
+// Returns false if the trace had to be executed synchronously instead.
+bool Trace::Launch(Thread & thread) {
+	Optimize(thread);
+
+	if(outputs.size() == 0 || !Launchable(thread)) {
+		if(outputs.size() > 0) {
+			Run(thread);
+			WriteOutputs(thread);
+		}
+		Reset();
+		return false;
+	}
+
+	JITLaunch(thread);
+	return true;
+}
+
+// Compile the whole trace and queue it for the other threads, so it runs
+// alongside the other traces being flushed with it. Returns false if there
+// was nothing to run or it had to be run right away.
+bool Trace::Dispatch(Thread & thread) {
+	Optimize(thread);
+	if(outputs.size() == 0)
+		return false;
+	if(!thread.state.epeeCompile) {
+		Run(thread);
 		WriteOutputs(thread);
+		return false;
+	}
+	JITLaunch(thread);
+	return true;
+}
+
+// Wait for a dispatched trace and write its results to the locations
+// found when it was optimized. Nothing ran in the meantime, so they still hold.
+void Trace::Finish(Thread & thread) {
+	JITJoin(thread);
+	WriteOutputs(thread);
+}
+
+// Traces of different lengths are independent of each other, so instead of
+// running them one after another, each with its own fork and join, all of
+// them are started before waiting on any. The workers are woken once and
+// steal chunks of whichever loops are still left.
+void Traces::Flush(Thread & thread) {
+	Join(thread);
+
+	timespec begin = get_time();
+	std::vector<Trace*> dispatched;
+	int64_t work = 0;
+	for(std::map<int64_t, Trace*>::const_iterator i = traces.begin(); i != traces.end(); i++) {
+		Trace* trace = i->second;
+		if(trace->Dispatch(thread)) {
+			dispatched.push_back(trace);
+			work += trace->Size;
+		}
+		else {
+			trace->Reset();
+			availableTraces.push_back(trace);
+		}
+	}
+	traces.clear();
+
+	double setup = 0;
+	for(size_t i = 0; i < dispatched.size(); i++) {
+		dispatched[i]->Finish(thread);
+		setup += dispatched[i]->setup;
+	}
+
+	// the loops shared the workers, charge each for its share of the elements
+	double run = std::max(time_elapsed(begin) - setup, 0.0);
+	for(size_t i = 0; i < dispatched.size(); i++) {
+		Trace* trace = dispatched[i];
+		Observe(trace, trace->setup, run * trace->Size / work);
+		trace->Reset();
+		availableTraces.push_back(trace);
+	}
+}
+
+// The vector a launched trace is computing for the future at ref,
+// if it can be read as soon as the trace finishes.
+Vector const* Trace::Result(IRef ref) const {
+	for(size_t i = 0; i < outputs.size(); i++) {
+		Output const& o = outputs[i];
+		if(o.future == ref && o.type != Output::TRACE) {
+			IRNode const& node = nodes[o.ref];
+			if(	(node.group == IRNode::MAP || node.group == IRNode::GENERATOR) &&
+				node.outShape == (IRNode::Shape) { Size, -1, 1, -1, false })
+				return &node.out;
+			return 0;
+		}
 	}
+	return 0;
+}
+
+void Trace::WriteFuture(Value& v) {
+	if(v.isFuture() && ((Future const&)v).trace() == this) {
+		IRef ref = ((Future const&)v).ref();
+		for(size_t i = 0; i < outputs.size(); i++) {
+			if(outputs[i].future == ref) {
+				v = WithAttributes(v, nodes[outputs[i].ref].out);
+				return;
+			}
+		}
+	}
+}
+
+// Wait for a launched trace and write its results back.
+// The interpreter kept going while we ran, so the locations found at launch
+// may have been overwritten and our futures may have been copied elsewhere.
+// Instead of using the recorded locations, replace any future that still refers to us.
+void Trace::Join(Thread & thread, Value* bound) {
+	JITJoin(thread);
+	// ran alongside the interpreter, so only the telemetry counts it
+	thread.traces.Tally(this, setup, time_elapsed(started));
+
+	for(Value* v = thread.registers;
+		v < thread.frame.registers + thread.frame.prototype->registers; 
+		v++) {
+		WriteFuture(*v);
+	}
+
+	for(std::set<Environment*>::const_iterator i = liveEnvironments.begin(); i != liveEnvironments.end(); ++i) {
+		std::vector<Environment::Pointer> pointers;
+		for(Environment::const_iterator j = (*i)->begin(); j != (*i)->end(); ++j) {
+			Value const& v = j.value();
+			if(v.isFuture() && ((Future const&)v).trace() == this)
+				pointers.push_back((*i)->makePointer(j.string()));
+		}
+		for(size_t j = 0; j < pointers.size(); j++) {
+			Value v = Environment::getPointer(pointers[j]);
+			WriteFuture(v);
+			Environment::assignPointer(pointers[j], v);
+		}
+
+		for(size_t j = 0; j < (*i)->dots.size(); j++) {
+			WriteFuture((*i)->dots[j].v);
+		}
+	}
+
+	if(bound != 0)
+		WriteFuture(*bound);
+
 	Reset();
 }
@@ -10,8 +10,18 @@
 //maximum number of instructions to record before dropping out of the
 //recording interpreter
 #define TRACE_MAX_RECORDED (1024)
+//traces that grow past this many nodes are split, running the front
+//and recording on with the rest
+#define TRACE_SPLIT_NODES (2048)
+
+// Scans and filtered stores are done independently for each block of
+// the trace and stitched together once it finishes. The block interpreter
+// evaluates the trace one block at a time.
+#define TRACE_BLOCK_BITS (10)
+#define TRACE_BLOCK (1 << TRACE_BLOCK_BITS)
 
 struct TraceCodeBuffer;
+struct TraceJIT;
 class Trace {
 
 	public:	
@@ -20,23 +30,38 @@ class Trace {
 		std::set<Environment*> liveEnvironments;
 
 		struct Output {
-			enum Type { REG, MEMORY };
+			enum Type { REG, MEMORY, TRACE };
 			Type type;
 			union {
 				Value* reg;
 				Environment::Pointer pointer;
+				IRef node;	// load in the rest of a partially executed trace
 			};
 			IRef ref;	   //location of the associated store
+			IRef future;	   //node the future in this location refers to
 		};
 
 		std::vector<Output> outputs;
 
 		TraceCodeBuffer * code_buffer;
 
+		// state of a trace launched asynchronously
+		TraceJIT * launched;
+		std::vector<Value> roots;	// vectors the running trace reads and writes, kept alive by the GC
+		std::set<Trace*> dependencies;	// launched traces whose results this trace loads
+
 		size_t n_recorded_since_last_exec;
 
 		int64_t Size;
 
+		Instruction const* site;	// instruction that started recording the trace
+		String source;			// and the source and bytecode offset of the function it's in
+		int64_t pc;
+		double setup;			// seconds spent optimizing and compiling it
+		int64_t recorded;		// nodes it had before it was optimized
+		int64_t spills;			// registers the JIT spilled to the stack
+		timespec started;		// when it was launched
+
 		Trace();
 
         std::string stringify() const;
@@ -51,7 +76,7 @@ class Trace {
 		IRef EmitSplit(IRef x, IRef f, int64_t levels);
 
 		IRef EmitGenerator(IROpCode::Enum op, Type::Enum type, int64_t length, int64_t a, int64_t b);
-		IRef EmitRandom(int64_t length);
+		IRef EmitRandom(int64_t length, int64_t seed, int64_t stream);
 		IRef EmitIndex(int64_t length, int64_t a, int64_t b);
 		IRef EmitSequence(int64_t length, int64_t a, int64_t b);
 		IRef EmitSequence(int64_t length, double a, double b);
@@ -62,7 +87,15 @@ class Trace {
 		IRef EmitSStore(IRef ref, int64_t index, IRef value);
 
         IRef GetRef(Value const& v) {
-            if(v.isFuture()) return ((Future const&)v).ref();
+            if(v.isFuture()) {
+                Future const& f = (Future const&)v;
+                if(f.trace() == this) return f.ref();
+                // a future of a launched trace, read its result once that trace has finished
+                Vector const* r = f.trace()->Result(f.ref());
+                if(r == 0) _error("GetRef on a launched future that isn't a vector");
+                dependencies.insert(f.trace());
+                return EmitLoad(*r, r->length(), 0);
+            }
             else if(v.isVector()) {
                 Vector const& vec = (Vector const&)v;
                 if(vec.isScalar()) return EmitConstant(vec.type(), 1, vec.i);
@@ -73,15 +106,32 @@ class Trace {
 
 		void Execute(Thread & thread);
 		void Execute(Thread & thread, IRef ref);
+		IRef Cut(Thread & thread);
+		void Split(Thread & thread, IRef cut);
 		void Reset();
 
+		bool Launchable(Thread const& thread) const;
+		bool Launch(Thread & thread);
+		void Join(Thread & thread, Value* bound);
+		bool Dispatch(Thread & thread);
+		void Finish(Thread & thread);
+		bool Launched() const { return launched != 0; }
+		Vector const* Result(IRef ref) const;
+
 	private:
 		void WriteOutputs(Thread & thread);
+		void WriteFuture(Value& v);
 		std::string toString(Thread & thread);
 
+		void Partial(Thread & thread, std::vector<bool> const& needed);
+		void Compact(Thread & thread);
+		void Run(Thread & thread);
 		void Interpret(Thread & thread);
 		void Optimize(Thread& thread);
 		void JIT(Thread & thread);
+		void JITLaunch(Thread & thread);
+		void JITJoin(Thread & thread);
+		void Announce(Thread & thread, void const* code, int64_t size, std::vector<int> const& offsets);
 
 		void MarkLiveOutputs(Thread& thread);
 		void SimplifyOps(Thread& thread);
@@ -94,15 +144,125 @@ class Trace {
 		void ShapePropogation(Thread& thread);
 };
 
+// What the traces an instruction started have cost to set up,
+// and totals over all of them for trace.stats and --trace-stats.
+struct TraceSite {
+    bool record;        // does the site currently start traces for mid-sized vectors
+    double setup;       // running average of the seconds a trace took to optimize and compile
+    double nodes;       // and of the nodes it had
+
+    String source;      // where the site is
+    int64_t pc;
+    int64_t traces;
+    int64_t recorded;   // nodes before optimizing
+    int64_t optimized;  // and after
+    double compile;     // seconds spent optimizing and compiling
+    double execute;     // and running
+    int64_t elements;
+    int64_t spills;
+    int64_t bytes;      // written to the vectors the traces materialized
+    int64_t launched;   // traces that ran in the background
+
+    TraceSite() : record(true), setup(0), nodes(0), source(0), pc(0), traces(0),
+        recorded(0), optimized(0), compile(0), execute(0), elements(0), spills(0), bytes(0), launched(0) {}
+};
+
+// e.g. "function(x) {:12", the first line of the source and the bytecode offset
+std::string SiteName(String source, int64_t pc);
+
+// Elements in each chunk whose fold partials deterministic mode merges in a fixed
+// tree. Depends only on the length and on the partials' width, never on the threads.
+int64_t DeterministicChunk(int64_t size, int64_t width);
+
+// How fast this machine streams memory and computes, measured once at startup (see trace_tune.cpp)
+struct Machine {
+	double bandwidth;	// bytes a second one thread streams
+	double saturated;	// and all of them together
+	double ops;	// arithmetic operations a second on one thread
+	double calls;	// and calls to math functions like exp
+};
+
+// How many threads a trace's elements should keep busy and in what chunks
+struct TraceSchedule {
+	int64_t threads;
+	uint64_t ppt;
+};
+
+// measures the machine the first time it's called with more than one thread
+void CalibrateMachine(Thread& thread);
+TraceSchedule Schedule(Thread const& thread, int64_t size, double bytes, double ops, double calls);
+
 class Traces {
     private:
         std::vector<Trace*> availableTraces;
         std::map< int64_t, Trace*> traces;
+        Trace* running;         // trace executing asynchronously on the other threads
         bool const& enabled;    // reference to global enabled state
+        int64_t const& minLength;   // and to the shortest vector worth recording
+
+        std::map<Instruction const*, TraceSite> sites;
+        Instruction const* site;    // instruction deciding whether to record
+        String source;              // where it is, for profilers
+        int64_t pc;
+        double immediate;       // seconds per element to run an op right away
+        double traced;          // running average of the seconds per element and node in a trace
+        bool fresh;             // a trace of a new length started recording since the last OptBind
+
+        bool isProfitable(Thread& thread, Instruction const& inst, int64_t length);
+
+        void Launch(Thread& thread, Trace* trace) {
+            // only one trace runs asynchronously at a time
+            Join(thread);
+            traces.erase(trace->Size);
+            if(trace->Launch(thread)) {
+                running = trace;
+                sites[trace->site].launched++;
+            }
+            else
+                availableTraces.push_back(trace);
+        }
+
+        bool Overlaps(Thread& thread, Trace const* trace);
+
+        // A trace of a new length started, so the interpreter has moved on from
+        // the others. Run the biggest of them in the background if it's worth it.
+        void LaunchIdle(Thread& thread, Trace const* current) {
+            if(running != 0) return;   // don't wait on it here
+            Trace* best = 0;
+            for(std::map<int64_t, Trace*>::const_iterator i = traces.begin(); i != traces.end(); ++i) {
+                Trace* t = i->second;
+                if(t != current && t->Launchable(thread) && Overlaps(thread, t) &&
+                    (best == 0 || t->Size * t->nodes.size() > best->Size * best->nodes.size()))
+                    best = t;
+            }
+            if(best != 0)
+                Launch(thread, best);
+        }
+
+        void Join(Thread& thread, Value* bound = 0) {
+            if(running != 0) {
+                Trace* trace = running;
+                running = 0;
+                trace->Join(thread, bound);
+                availableTraces.push_back(trace);
+            }
+        }
 
     public:
 
-        Traces(bool const& enabled) : enabled(enabled) {}
+        Traces(bool const& enabled, int64_t const& minLength) : running(0), enabled(enabled), minLength(minLength), site(0), source(0), pc(0), immediate(0), traced(0), fresh(false) {}
+
+        Trace const* Running() const {
+            return running;
+        }
+
+        std::map<int64_t, Trace*> const& Recording() const {
+            return traces;
+        }
+
+        std::map<Instruction const*, TraceSite> const& Sites() const {
+            return sites;
+        }
 
         Type::Enum futureType(Value const& v) {
             if(v.isFuture()) 
@@ -128,8 +288,12 @@ class Traces {
                 Trace* t = availableTraces.back();
                 t->Reset();
                 t->Size = length;
+                t->site = site;
+                t->source = source;
+                t->pc = pc;
                 traces[length] = t;
                 availableTraces.pop_back();
+                fresh = true;
             }
             return traces[length];
         }
@@ -233,10 +397,10 @@ class Traces {
             return v;
         }
 
-        Value EmitRandom(Environment* env, int64_t length) {
+        Value EmitRandom(Environment* env, int64_t length, int64_t seed, int64_t stream) {
             Trace* trace = getTrace(length);
             trace->liveEnvironments.insert(env);
-            IRef r = trace->EmitRandom(length);
+            IRef r = trace->EmitRandom(length, seed, stream);
             Value v;
             Future::Init(v, trace, r);
             return v;
@@ -316,7 +480,7 @@ class Traces {
 
         void LiveEnvironment(Environment* env, Value const& a) {
             if(a.isFuture()) {
-                Trace* trace = getTrace(a);
+                Trace* trace = ((Future const&)a).trace();
                 trace->liveEnvironments.insert(env);
             }
         }
@@ -325,36 +489,89 @@ class Traces {
             for(std::map<int64_t, Trace*>::const_iterator i = traces.begin(); i != traces.end(); i++) {
                 i->second->liveEnvironments.erase(env);
             }
+            if(running != 0)
+                running->liveEnvironments.erase(env);
         }
 
         void Bind(Thread& thread, Value const& v) {
             if(!v.isFuture()) return;
             Trace* trace = ((Future const&)v).trace();
+            // only block on a launched trace if we actually need its results
+            if(trace == running) {
+                Join(thread, (Value*)&v);
+                return;
+            }
+            if(running != 0 && trace->dependencies.count(running) > 0)
+                Join(thread);
+            // the bound value may live somewhere MarkLiveOutputs doesn't look (e.g. call arguments)
+            Trace::Output o;
+            o.type = Trace::Output::REG;
+            o.reg = (Value*)&v;
+            o.ref = ((Future const&)v).ref();
+            o.future = o.ref;
+            trace->outputs.push_back(o);
             trace->Execute(thread, ((Future const&)v).ref());
-            trace->Reset();
-            availableTraces.push_back(trace);
-            traces.erase(trace->Size);
-        }
-
-        void Flush(Thread & thread) {
-            // execute all traces
-            for(std::map<int64_t, Trace*>::const_iterator i = traces.begin(); i != traces.end(); i++) {
-                Trace* trace = i->second;
-                trace->Execute(thread);
-                trace->Reset();
+            // partial execution may leave the rest of the trace recording
+            if(trace->nodes.size() == 0) {
                 availableTraces.push_back(trace);
+                traces.erase(trace->Size);
             }
-            traces.clear();
         }
 
+        void Flush(Thread & thread);
+
         void OptBind(Thread& thread, Value const& v) {
             if(!v.isFuture()) return;
             Trace* trace = ((Future const&)v).trace();
-            if(trace->nodes.size() > 2048) {
-                Bind(thread, v);
+            if(fresh) {
+                fresh = false;
+                LaunchIdle(thread, trace);
+            }
+            if(trace->nodes.size() >= TRACE_SPLIT_NODES) {
+                IRef cut = trace->Cut(thread);
+                if(cut >= 0 && cut < (IRef)trace->nodes.size()) {
+                    if(running != 0 && trace->dependencies.count(running) > 0)
+                        Join(thread);
+                    trace->Split(thread, cut);
+                    if(trace->nodes.size() == 0) {
+                        availableTraces.push_back(trace);
+                        traces.erase(trace->Size);
+                    }
+                }
+                else {
+                    // nobody is waiting on this trace yet, so run it in the background
+                    Launch(thread, trace);
+                }
             }
         }
 
+        // Vectors that aren't recorded yet and are neither clearly too short nor
+        // clearly long enough only start a trace if fusing them pays for the setup
+        // the site's traces have needed.
+        bool isProfitable(Thread& thread, Instruction const& inst, Value const& a) {
+            Site(thread, inst);
+            return a.isFuture() || isProfitable(thread, inst, futureShape(a).length);
+        }
+
+        bool isProfitable(Thread& thread, Instruction const& inst, Value const& a, Value const& b) {
+            Site(thread, inst);
+            return a.isFuture() || b.isFuture() ||
+                isProfitable(thread, inst, std::max(futureShape(a).length, futureShape(b).length));
+        }
+
+        // generators have no operands, only the length of the vector they'd make
+        bool isProfitable(Thread& thread, Instruction const& inst, Type::Enum type, int64_t length) {
+            Site(thread, inst);
+            return enabled &&
+                (type == Type::Double || type == Type::Integer || type == Type::Logical) &&
+                isProfitable(thread, inst, length);
+        }
+
+        void Site(Thread& thread, Instruction const& inst);
+        void Observe(Trace const* trace, double setup, double run);
+        void Tally(Trace const* trace, double setup, double run);
+        void WriteStats(std::ostream& out) const;
+
         bool isTraceableType(Value const& a) {
             Type::Enum type = futureType(a);
             return type == Type::Double || type == Type::Integer || type == Type::Logical;
@@ -362,7 +579,7 @@ class Traces {
 
         bool isTraceableShape(Value const& a) {
             IRNode::Shape const& shape = futureShape(a);
-            return !shape.blocking && shape.length >= TRACE_VECTOR_WIDTH;
+            return !shape.blocking && shape.length >= minLength;
         }
 
         bool isTraceableShape(Value const& a, Value const& b) {
@@ -370,21 +587,35 @@ class Traces {
             IRNode::Shape const& shapeb = futureShape(b);
             return 	!shapea.blocking &&
                 !shapeb.blocking &&
-                (shapea.length >= TRACE_VECTOR_WIDTH || shapeb.length >=TRACE_VECTOR_WIDTH) &&
+                (shapea.length >= minLength || shapeb.length >= minLength) &&
                 !(a.isFuture() && b.isFuture() && shapea.length != shapeb.length);
         }
 
+        // futures of a launched trace can only be recorded on if their result is a plain vector
+        bool isLoadable(Value const& a) {
+            return !a.isFuture() ||
+                !((Future const&)a).trace()->Launched() ||
+                ((Future const&)a).trace()->Result(((Future const&)a).ref()) != 0;
+        }
+
+        bool isRunning(Value const& a) {
+            return a.isFuture() && ((Future const&)a).trace()->Launched();
+        }
+
         bool isTraceable(Value const& a) {
             return enabled &&	
                 isTraceableType(a) &&
-                isTraceableShape(a);
+                isTraceableShape(a) &&
+                isLoadable(a);
         }
 
         bool isTraceable(Value const& a, Value const& b) {
             return enabled &&
                 isTraceableType(a) && 
                 isTraceableType(b) && 
-                isTraceableShape(a, b);
+                isTraceableShape(a, b) &&
+                isLoadable(a) &&
+                isLoadable(b);
         }
 
         template< template<class X> class Group>
@@ -404,11 +635,22 @@ class Traces {
 
 };
 
+// scans run as a parallel prefix over the full, unfiltered vector
 template<>
-inline bool Traces::isTraceable<ArithScan>(Value const& a) { return false; }
+inline bool Traces::isTraceable<ArithScan>(Value const& a) { 
+    return isTraceable(a) &&
+        futureShape(a).filter < 0 &&
+        futureShape(a).split < 0;
+}
 
+// the JIT only has a double min/max
 template<>
-inline bool Traces::isTraceable<UnifyScan>(Value const& a) { return false; }
+inline bool Traces::isTraceable<UnifyScan>(Value const& a) { 
+    return isTraceable(a) &&
+        futureType(a) == Type::Double &&
+        futureShape(a).filter < 0 &&
+        futureShape(a).split < 0;
+}
 
 template<>
 inline bool Traces::isTraceable<IfElse>(Value const& a, Value const& b, Value const& c) { 
@@ -417,7 +659,10 @@ inline bool Traces::isTraceable<IfElse>(Value const& a, Value const& b, Value co
         isTraceableType(b) &&
         isTraceableType(c) &&
         isTraceableShape(a, c) &&
-        isTraceableShape(b, c);
+        isTraceableShape(b, c) &&
+        isLoadable(a) &&
+        isLoadable(b) &&
+        isLoadable(c);
 }
 
 #endif
@@ -8,6 +8,7 @@
 #include "../runtime.h"
 #include "assembler-x64.h"
 #include "register_set.h"
+#include "moments.h"
 
 #ifdef USE_AMD_LIBM
 #include <amdlibm.h>
@@ -20,6 +21,13 @@ using namespace v8::internal;
 
 #define BIG_CARDINALITY 1024 
 
+// Group-bys with more than BIG_CARDINALITY levels, and more accumulators across
+// the threads than elements, are radix partitioned on the group instead, so that
+// each partition's slice of the result (2^PARTITION_BITS groups or more) stays
+// in cache while it is aggregated
+#define PARTITION_BITS (12)
+#define MAX_PARTITIONS (1024)
+
 struct Constant {
 	Constant() {}
 	Constant(int64_t i)
@@ -263,70 +271,40 @@ static __m128d log_d(__m128d input) {
        return v.D;
 }
 
-static __m128d random_d(__m128d input) {
-	/*SSEValue v; 
-	v.D = input;
-
-	// TODO: fix me
-
-	uint64_t thread_index = v.i[0];
-	
-	Thread::RandomSeed& r = Thread::seed[thread_index];
-	
-	// advance three times to avoid taking powers of 2
-	r.v[0] = r.v[0] * r.m[0] + r.a[0];
-	r.v[1] = r.v[1] * r.m[1] + r.a[1];
-	r.v[0] = r.v[0] * r.m[0] + r.a[0];
-	r.v[1] = r.v[1] * r.m[1] + r.a[1];
-	r.v[0] = r.v[0] * r.m[0] + r.a[0];
-	r.v[1] = r.v[1] * r.m[1] + r.a[1];
-
-	SSEValue o;
-
-	o.d[0] = (double)r.v[0] / ((double)std::numeric_limits<uint64_t>::max() + 1);
-	o.d[1] = (double)r.v[1] / ((double)std::numeric_limits<uint64_t>::max() + 1);
-	
-	return o.D;
-	*/
-
-	return input;
+// the lanes at vector_index of a random() stream
+static __m128d random_d(uint64_t seed, uint64_t stream, uint64_t index) {
+	return Random::uniform(seed, stream, index/2);
 }
 
-static void double_push(Double* d, double v) {
-	if(d->length() >= 1) {
-		if(d->length() == (int64_t)nextPow2(d->length())) {
-			// reallocate and copy
-			Double n(nextPow2(d->length()+1));
-			memcpy(n.v(), d->v(), d->length()*sizeof(double));
-			d->p = n.p;
-		}
-		(*d)[d->inner()->length++] = v;
-	} else {
-		Double::InitScalar(*d, v);
-	} 
-}
+// Filtered stores compact each block in place at the front of its
+// slice of the output. GlobalReduce later packs the blocks together.
+struct FilterState {
+	char* next;	// where the block's next kept element goes
+	int64_t end;	// length of the trace, the lane past it is padding
+	int64_t block;
+};
 
-static __m128d store_conditional(__m128d input, __m128i mask, Value* out) {
+static __m128d store_conditional(__m128d input, __m128i mask, FilterState* state, int64_t index) {
 	SSEValue i, m; 
 	i.D = input;
 	m.I = mask;
+	int64_t* next = (int64_t*)state->next;
 	if(m.i[0] == -1)
-		double_push((Double*)out, i.d[0]); 
-		//((double*)(out->p))[out->length++] = i.d[0];
-	if(m.i[1] == -1) 
-		double_push((Double*)out, i.d[1]); 
-		//((double*)(out->p))[out->length++] = i.d[1];
+		*next++ = i.i[0];
+	if(m.i[1] == -1 && index+1 < state->end)
+		*next++ = i.i[1];
+	state->next = (char*)next;
 	return input;
 }
 
-static __m128d store_conditional_l(__m128d input, __m128i mask, Logical* out) {
+static __m128d store_conditional_l(__m128d input, __m128i mask, FilterState* state, int64_t index) {
 	SSEValue i, m; 
 	i.D = input;
 	m.I = mask;
 	if(m.i[0] == -1) 
-		((char*)(out->p))[out->inner()->length++] = (char)i.i[0];
-	if(m.i[1] == -1) 
-		((char*)(out->p))[out->inner()->length++] = (char)i.i[1];
+		*state->next++ = (char)i.i[0];
+	if(m.i[1] == -1 && index+1 < state->end) 
+		*state->next++ = (char)i.i[1];
 	return input;
 }
 
@@ -374,6 +352,20 @@ static __m128d name (__m128d input, type * last) { \
 	return in; \
 }
 
+FOLD_FN(prodi, int64_t, *)
+FOLD_FN(prodd, double , *)
+*/
+
+// Scans run a block at a time. The running value of the block is
+// carried in *last; the carries between blocks are fixed up after
+// the trace finishes (see GlobalReduce).
+
+#define SCAN_ADD(a, b) ((a) + (b))
+#define SCAN_MUL(a, b) ((a) * (b))
+// NaN in either operand propagates
+#define SCAN_MIN(a, b) (((a) != (a) || (a) < (b)) ? (a) : (b))
+#define SCAN_MAX(a, b) (((a) != (a) || (a) > (b)) ? (a) : (b))
+
 #define SCAN_FN(name, type, op) \
 static __m128d name(__m128d input, type * last) { \
 	union { \
@@ -381,18 +373,45 @@ static __m128d name(__m128d input, type * last) { \
 		type i[2]; \
 	}; \
 	in = input; \
-	i[0] = *last op i[0]; \
-	*last = i[1] = i[0] op i[1]; \
+	i[0] = op(*last, i[0]); \
+	*last = i[1] = op(i[0], i[1]); \
 	return in; \
+} \
+static void name##_fixup(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) { \
+	IRNode const& node = *(IRNode const*)args; \
+	type const* carry = (type const*)node.in.raw(); \
+	type* out = (type*)node.out.raw(); \
+	for(uint64_t j = start; j < end; j++) \
+		out[j] = op(carry[j/TRACE_BLOCK], out[j]); \
+} \
+static void name##_carry(IRNode& node, type identity) { \
+	type* carry = (type*)node.in.raw(); \
+	type c = identity; \
+	for(int64_t j = 0; j < node.in.length(); j++) { \
+		type t = carry[j]; \
+		carry[j] = c; \
+		c = op(c, t); \
+	} \
 }
 
-FOLD_FN(prodi, int64_t, *)
-FOLD_FN(prodd, double , *)
-SCAN_FN(cumprodi, int64_t, *)
-SCAN_FN(cumprodd, double , *)
-SCAN_FN(cumsumi, int64_t, +)
-SCAN_FN(cumsumd, double , +)
-*/
+SCAN_FN(cumprodi, int64_t, SCAN_MUL)
+SCAN_FN(cumprodd, double , SCAN_MUL)
+SCAN_FN(cumsumi, int64_t, SCAN_ADD)
+SCAN_FN(cumsumd, double , SCAN_ADD)
+SCAN_FN(cummind, double , SCAN_MIN)
+SCAN_FN(cummaxd, double , SCAN_MAX)
+
+// Adds both lanes of x to the moments of their groups (see moments.h),
+// skipping filtered out lanes and the padding lane past the end.
+static __m128d momentsFold(__m128d x, __m128d f, __m128d s, double* acc, int64_t index, int64_t size, int64_t levels) {
+	SSEValue v, m, g;
+	v.D = x; m.D = f; g.D = s;
+	for(int64_t i = 0; i < 2; i++) {
+		if(m.i[i] != 0 && index+i < size && g.i[i] >= 0 && g.i[i] < levels)
+			Moments::add(acc + g.i[i]*Moments::Width, v.d[i]);
+	}
+	return x;
+}
 
 struct TraceJIT {
 	TraceJIT(Trace * t, Thread& thread)
@@ -401,7 +420,12 @@ struct TraceJIT {
 		// to make code gen easier for now 
 		live_registers = new RegisterSet[trace->nodes.size()];
 		allocated_register = new int8_t[trace->nodes.size()];
+		done = 0;
+	}
 
+	~TraceJIT() {
+		delete [] live_registers;
+		delete [] allocated_register;
 	}
 
 	Trace * trace;
@@ -418,6 +442,12 @@ struct TraceJIT {
 	Register vector_length; //holds length of long vector
 	uint32_t next_constant_slot;
 	uint64_t spills;
+	uint64_t spilled;	// registers spilled, for the telemetry
+	int64_t* done;	// completion counter of a launched trace
+	uint64_t alignment;	// chunks handed to the threads start on multiples of this
+	int64_t slots;	// partials each fold keeps, one per thread or per chunk
+	int64_t chunk;	// elements folded into each partial in deterministic mode, otherwise 0
+	TraceSchedule schedule;
 
 	struct RegisterAssignment {
 		int8_t r;
@@ -430,6 +460,7 @@ struct TraceJIT {
 
 	std::vector<OpAssignment> assignment;
 	IRef liveRegisters[14]; 
+	std::vector<int> offsets;	// where each node's code starts in the loop body
 
 	bool usesNode(IRef ref, IRef use) {
 		IRNode node = trace->nodes[ref];
@@ -450,6 +481,7 @@ struct TraceJIT {
 
 	int8_t spillRegister(IRef currentOp) {
 		spills++;
+		spilled++;
 		// look for register with the farthest away use?
 		// for now just do slow search backwards
 		IRef minUse = std::numeric_limits<IRef>::max();
@@ -502,6 +534,7 @@ struct TraceJIT {
 
 	void RegisterAllocate() {
 		spills = 16;
+		spilled = 0;
 		assignment.resize(trace->nodes.size());
 		for(size_t i = 0; i < trace->nodes.size(); i++) {
 			allocated_register[i] = -1;
@@ -619,27 +652,58 @@ struct TraceJIT {
 				stackSpace += 0x10;
 			else if(node.op == IROpCode::index)
 				stackSpace += 0x20;
-			else if(node.op == IROpCode::random)
-				stackSpace += 0x10;
 			else if(node.group == IRNode::FOLD)
 				stackSpace += 0x10;
+			else if(node.group == IRNode::SCAN)
+				stackSpace += 0x20;
+			if(FilteredStore(node))
+				stackSpace += 0x20;
 
 
-			// TODO: allocate thread split filtered output (how to maintain ordering?)
 			// allocate temporary space for folds (put in IRNode::in)
-			if(node.group == IRNode::FOLD) {
+			if(PartitionedFold(node)) {
+				// a (group, value) pair for every element, padding included
+				int64_t size = (trace->Size+1) & ~1LL;
+				if(node.type == Type::Double)
+					node.in = Double(size*2);
+				else
+					node.in = Integer(size*2);
+			}
+			else if(node.op == IROpCode::moments) {
+				// both lanes share a thread's state, so unlike the other folds there's one per group
+				Double in((node.shape.levels*Moments::Width + 16LL)*slots);
+				for(int64_t i = 0; i+Moments::Width <= in.length(); i += Moments::Width)
+					Moments::init(in.v()+i);
+				node.in = in;
+			}
+			else if(node.group == IRNode::FOLD) {
 				int64_t size = node.shape.levels <= BIG_CARDINALITY ? node.shape.levels*2 : node.shape.levels;
 				if(node.type == Type::Double) {
 					// 16 min fills possibly unaligned cache line
-					node.in = Double((size+16LL)*thread.state.threads.size());
+					node.in = Double((size+16LL)*slots);
 				} else if(node.type == Type::Integer) {
-					node.in = Integer((size+16LL)*thread.state.threads.size());
+					node.in = Integer((size+16LL)*slots);
 				} else if(node.type == Type::Logical) {
-					node.in = Logical((size+128LL)*thread.state.threads.size());
+					node.in = Logical((size+128LL)*slots);
 				} else {
 					_error("Unknown type in initialize temporary space");
 				}
 			}
+			// one carry per block for scans (at least 2, so it isn't packed)
+			if(node.group == IRNode::SCAN) {
+				int64_t blocks = std::max((trace->Size+TRACE_BLOCK-1)/TRACE_BLOCK, (int64_t)2);
+				if(node.type == Type::Double)
+					node.in = Double(blocks);
+				else if(node.type == Type::Integer)
+					node.in = Integer(blocks);
+				else
+					_error("Unknown type in initialize temporary space");
+			}
+			// where each block's filtered store ended
+			if(FilteredStore(node)) {
+				int64_t blocks = std::max((trace->Size+TRACE_BLOCK-1)/TRACE_BLOCK, (int64_t)2);
+				node.in = Integer(blocks);
+			}
 
 			// allocate outputs
 			if(node.liveOut || (node.group == IRNode::FOLD && node.outShape.length <= BIG_CARDINALITY)) { 
@@ -647,8 +711,6 @@ struct TraceJIT {
 				
 				if(node.shape.levels != 1 && node.group != IRNode::FOLD)
 					_error("Group by without aggregate not yet supported");
-				if(node.shape.filter >= 0 && node.group != IRNode::FOLD)
-					length = 0;
 				
 				if(node.type == Type::Double) {
 					node.out = Double(length);
@@ -705,13 +767,11 @@ struct TraceJIT {
 				asm_.movdqa(Operand(rsp, stackOffset), xmm0);
 				stackOffset += 0x10;
 			}
-			else if(node.op == IROpCode::random) {
-				asm_.movq(Operand(rsp, stackOffset), thread_index);
-				asm_.movq(Operand(rsp, stackOffset+0x8), thread_index);
+			else if(PartitionedFold(node)) {
 				stackOffset += 0x10;
 			}
 			else if(node.group == IRNode::FOLD) { 
-				int64_t step = node.in.length() / thread.state.threads.size();
+				int64_t step = node.in.length() / slots;
 				asm_.movq(r11, Immediate(step));
 				asm_.imulq(r11, thread_index);
 				asm_.movq(Operand(rsp, stackOffset), r11);
@@ -720,6 +780,28 @@ struct TraceJIT {
 				asm_.movq(Operand(rsp, stackOffset+0x8), r11);
 				stackOffset += 0x10;
 			}
+			else if(node.group == IRNode::SCAN) {
+				// running value starts at the identity, and remember which block we're in
+				asm_.movdqa(xmm0, PushConstant(ScanIdentity(node)));
+				asm_.movdqa(Operand(rsp, stackOffset), xmm0);
+				asm_.movq(r11, vector_index);
+				asm_.shr(r11, Immediate(TRACE_BLOCK_BITS));
+				asm_.movq(Operand(rsp, stackOffset+0x10), r11);
+				stackOffset += 0x20;
+			}
+			if(FilteredStore(node)) {
+				// this block's kept elements start at the front of its slice of the output
+				asm_.lea(r11, Operand(vector_index, node.isLogical() ? times_1 : times_8, 0));
+				asm_.movq(r10, node.out.raw());
+				asm_.addq(r11, r10);
+				asm_.movq(Operand(rsp, stackOffset), r11);
+				asm_.movq(r11, (int64_t)trace->Size);
+				asm_.movq(Operand(rsp, stackOffset+0x8), r11);
+				asm_.movq(r11, vector_index);
+				asm_.shr(r11, Immediate(TRACE_BLOCK_BITS));
+				asm_.movq(Operand(rsp, stackOffset+0x10), r11);
+				stackOffset += 0x20;
+			}
 		}
 
 		// clear register assignments
@@ -732,9 +814,10 @@ struct TraceJIT {
 		asm_.bind(&begin);
 
 		stackOffset = spills*0x10;
+		offsets.resize(trace->nodes.size());
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
-
+			offsets[ref] = asm_.pc_offset();
 
 			// unspill if necessary...
 			if(node.group != IRNode::SCALAR) {
@@ -753,7 +836,11 @@ struct TraceJIT {
 				}
 				allocated_register[ref] = assignment[ref].r.r;
 			}
-			switch(node.op) {
+			if(PartitionedFold(node)) {
+				EmitPartitionStore(ref);
+				stackOffset += 0x10;
+			}
+			else switch(node.op) {
 
 			case IROpCode::constant: {
 				Constant c;
@@ -801,12 +888,22 @@ struct TraceJIT {
 						p = ((Double&)node.in).v();
 					else
 						_error("Unsupported type");
-			
-					asm_.movq(r8, RegA(ref));
-					asm_.movhlps(RegR(ref), RegA(ref));
-					asm_.movq(r9, RegR(ref));
-					asm_.movlpd(RegR(ref),EncodeOperand(p,r8,times_8));
-					asm_.movhpd(RegR(ref),EncodeOperand(p,r9,times_8));
+
+					EmitPrefetch(node, p);
+					if(HasAVX2()) {
+						// the gather clears its mask, so it is rebuilt every time
+						XMMRegister dst = RegR(ref).is(RegA(ref)) ? xmm14 : RegR(ref);
+						asm_.movdqa(xmm15, ConstantTable(C_NOT_MASK));
+						asm_.movq(load_addr, p);
+						asm_.vgatherqpd(dst, load_addr, RegA(ref), xmm15);
+						EmitMove(RegR(ref), dst);
+					} else {
+						asm_.movq(r8, RegA(ref));
+						asm_.movhlps(RegR(ref), RegA(ref));
+						asm_.movq(r9, RegR(ref));
+						asm_.movlpd(RegR(ref),EncodeOperand(p,r8,times_8));
+						asm_.movhpd(RegR(ref),EncodeOperand(p,r9,times_8));
+					}
 				}
 			} break;
 
@@ -1016,13 +1113,13 @@ struct TraceJIT {
 				stackOffset += 0x10;
 			} break;
 			case IROpCode::random: {
-				asm_.movdqa(RegR(ref),Operand(rsp, stackOffset));
 				SaveRegisters(ref);
-				asm_.movapd(xmm0, RegR(ref));
+				asm_.movq(rdi, node.sequence.ia);
+				asm_.movq(rsi, node.sequence.ib);
+				asm_.movq(rdx, vector_index);
 				EmitCall((void*)random_d);
 				EmitMove(RegR(ref),xmm0);
 				RestoreRegisters(ref);
-				stackOffset += 0x10;
 			} break;
 			case IROpCode::sum:  {
 				// relying on doubles and integers to be the same length
@@ -1045,8 +1142,8 @@ struct TraceJIT {
 					asm_.movq(r9, xmm15);
 					qq++;
 					}
-					Operand operand0 = EncodeOperand(node.in.p, r8, times_8);
-					Operand operand1 = EncodeOperand(node.in.p, r9, times_8);
+					Operand operand0 = EncodeOperand(node.in.raw(), r8, times_8);
+					Operand operand1 = EncodeOperand(node.in.raw(), r9, times_8);
 				
 					if(node.shape.levels > BIG_CARDINALITY) {
 						asm_.movhlps(xmm15, RegR(ref));
@@ -1107,29 +1204,21 @@ struct TraceJIT {
 					Operand operand0 = EncodeOperand(node.in.raw(), r8, times_8);
 					Operand operand1 = EncodeOperand(node.in.raw(), r9, times_8);
 				
-					if(node.shape.levels <= BIG_CARDINALITY) {
-						asm_.movhlps(xmm15, RegR(ref));
-						if(node.isDouble())	asm_.addsd(RegR(ref), operand0);
-						else {
-							asm_.movq(xmm14, operand0);
-							asm_.paddq(RegR(ref), xmm14);
-						}
-						asm_.movq(operand0, RegR(ref));
-						if(node.isDouble())	asm_.addsd(xmm15, operand1);
-						else {
-							asm_.movq(xmm14, operand1);
-							asm_.paddq(xmm15, xmm14);
-						}
-						asm_.movq(operand1, xmm15);
-						asm_.movlhps(RegR(ref), xmm15);
-					} else {
-						asm_.movlpd(RegR(ref), operand0);
-						asm_.movhpd(RegR(ref), operand1);
-						if(node.isDouble())	asm_.addpd(RegR(ref), operand0);
-						else 			asm_.paddq(RegR(ref), operand1);
-						asm_.movlpd(operand0, RegR(ref));
-						asm_.movhpd(operand1, RegR(ref));
+					// one lane at a time, both may fall in the same group
+					asm_.movhlps(xmm15, RegR(ref));
+					if(node.isDouble())	asm_.addsd(RegR(ref), operand0);
+					else {
+						asm_.movq(xmm14, operand0);
+						asm_.paddq(RegR(ref), xmm14);
 					}
+					asm_.movq(operand0, RegR(ref));
+					if(node.isDouble())	asm_.addsd(xmm15, operand1);
+					else {
+						asm_.movq(xmm14, operand1);
+						asm_.paddq(xmm15, xmm14);
+					}
+					asm_.movq(operand1, xmm15);
+					asm_.movlhps(RegR(ref), xmm15);
 				} else {
 					asm_.movq(r8, offset);
 					Operand operand = EncodeOperand(node.in.raw(), r8, times_8);
@@ -1263,6 +1352,27 @@ struct TraceJIT {
 				stackOffset += 0x10;
 			} break;
 			
+			case IROpCode::moments: {
+				// too much state to keep in registers, so call out for each pair
+				asm_.movq(r8, Operand(rsp, stackOffset));
+				SaveRegisters(ref);
+				if(node.shape.filter >= 0)	EmitMove(xmm14, RegF(ref));
+				else				asm_.movdqa(xmm14, ConstantTable(C_NOT_MASK));
+				if(node.shape.split >= 0)	EmitMove(xmm15, RegS(ref));
+				else				asm_.pxor(xmm15, xmm15);
+				EmitMove(xmm0, RegA(ref));
+				EmitMove(xmm1, xmm14);
+				EmitMove(xmm2, xmm15);
+				asm_.movq(rdi, node.in.raw());
+				asm_.lea(rdi, Operand(rdi, r8, times_8, 0));
+				asm_.movq(rsi, vector_index);
+				asm_.movq(rdx, (int64_t)trace->Size);
+				asm_.movq(rcx, (int64_t)node.shape.levels);
+				EmitCall((void*)momentsFold);
+				RestoreRegisters(ref);
+				stackOffset += 0x10;
+			} break;
+
 			case IROpCode::min:  {
 				for(int64_t i = 0; i < node.in.length(); i++)
 					((Double&)node.in)[i] = std::numeric_limits<double>::infinity();
@@ -1288,23 +1398,15 @@ struct TraceJIT {
 					Operand operand0 = EncodeOperand(node.in.raw(), r8, times_8);
 					Operand operand1 = EncodeOperand(node.in.raw(), r9, times_8);
 				
-					if(node.shape.levels <= BIG_CARDINALITY) {
-						asm_.movhlps(xmm15, RegR(ref));
-						if(node.isDouble())	asm_.minsd(RegR(ref), operand0);
-						else			_error("NYI: min on integers");
-						asm_.movq(operand0, RegR(ref));
-						if(node.isDouble())	asm_.minsd(xmm15, operand1);
-						else 			_error("NYI: min on integers");
-						asm_.movq(operand1, xmm15);
-						asm_.movlhps(RegR(ref), xmm15);
-					} else {
-						asm_.movlpd(RegR(ref), operand0);
-						asm_.movhpd(RegR(ref), operand1);
-						if(node.isDouble())	asm_.minpd(RegR(ref), operand0);
-						else 			_error("NYI: min on integers");
-						asm_.movlpd(operand0, RegR(ref));
-						asm_.movhpd(operand1, RegR(ref));
-					}
+					// one lane at a time, both may fall in the same group
+					asm_.movhlps(xmm15, RegR(ref));
+					if(node.isDouble())	asm_.minsd(RegR(ref), operand0);
+					else			_error("NYI: min on integers");
+					asm_.movq(operand0, RegR(ref));
+					if(node.isDouble())	asm_.minsd(xmm15, operand1);
+					else 			_error("NYI: min on integers");
+					asm_.movq(operand1, xmm15);
+					asm_.movlhps(RegR(ref), xmm15);
 				} else {
 					asm_.movq(r8, offset);
 					Operand operand = EncodeOperand(node.in.raw(), r8, times_8);
@@ -1341,23 +1443,15 @@ struct TraceJIT {
 					Operand operand0 = EncodeOperand(node.in.raw(), r8, times_8);
 					Operand operand1 = EncodeOperand(node.in.raw(), r9, times_8);
 				
-					if(node.shape.levels <= BIG_CARDINALITY) {
-						asm_.movhlps(xmm15, RegR(ref));
-						if(node.isDouble())	asm_.maxsd(RegR(ref), operand0);
-						else			_error("NYI: max on integers");
-						asm_.movq(operand0, RegR(ref));
-						if(node.isDouble())	asm_.maxsd(xmm15, operand1);
-						else 			_error("NYI: max on integers");
-						asm_.movq(operand1, xmm15);
-						asm_.movlhps(RegR(ref), xmm15);
-					} else {
-						asm_.movlpd(RegR(ref), operand0);
-						asm_.movhpd(RegR(ref), operand1);
-						if(node.isDouble())	asm_.maxpd(RegR(ref), operand0);
-						else 			_error("NYI: max on integers");
-						asm_.movlpd(operand0, RegR(ref));
-						asm_.movhpd(operand1, RegR(ref));
-					}
+					// one lane at a time, both may fall in the same group
+					asm_.movhlps(xmm15, RegR(ref));
+					if(node.isDouble())	asm_.maxsd(RegR(ref), operand0);
+					else			_error("NYI: max on integers");
+					asm_.movq(operand0, RegR(ref));
+					if(node.isDouble())	asm_.maxsd(xmm15, operand1);
+					else 			_error("NYI: max on integers");
+					asm_.movq(operand1, xmm15);
+					asm_.movlhps(RegR(ref), xmm15);
 				} else {
 					asm_.movq(r8, offset);
 					Operand operand = EncodeOperand(node.in.raw(), r8, times_8);
@@ -1385,18 +1479,17 @@ struct TraceJIT {
 				}
 			} break;
 	
-			//placeholder for now
-			case IROpCode::cumsum: {
-				if(node.isDouble()) 
-					_error("Undefined vector op");
-				else
-					_error("Undefined vector op");
-			} break;
-			case IROpCode::cumprod: {
-				if(node.isDouble()) 
-					_error("Undefined vector op");
-				else
-					_error("Undefined vector op");
+			case IROpCode::cumsum: 
+			case IROpCode::cumprod:
+			case IROpCode::cummin:
+			case IROpCode::cummax: {
+				asm_.lea(rdi, Operand(rsp, stackOffset));
+				SaveRegisters(ref);
+				EmitMove(xmm0, RegA(ref));
+				EmitCall(ScanFunction(node));
+				EmitMove(RegR(ref), xmm0);
+				RestoreRegisters(ref);
+				stackOffset += 0x20;
 			} break;
 
 			case IROpCode::nop:
@@ -1465,17 +1558,20 @@ struct TraceJIT {
 			if(node.liveOut) {
 				switch(node.group) {
 					case IRNode::MAP:
-					case IRNode::GENERATOR: {
+					case IRNode::GENERATOR:
+					case IRNode::SCAN: {
 						if(Type::Logical == node.type)
-							EmitLogicalStore(ref, node.out, node.shape);
+							EmitLogicalStore(ref, node.out, node.shape, stackOffset);
 						else
-							EmitVectorStore(ref, node.out, node.shape);
+							EmitVectorStore(ref, node.out, node.shape, stackOffset);
 					} break;
 					default:
 						// do nothing...
 					break;
 				}
 			}
+			if(FilteredStore(node))
+				stackOffset += 0x20;
 
 
 			// spill if necessary...
@@ -1502,6 +1598,29 @@ struct TraceJIT {
 		asm_.cmpq(vector_index,vector_length);
 		asm_.j(less,&begin);
 
+		// save the total of this block for the carry propagation,
+		// and where its filtered stores ended for the compaction
+		stackOffset = spills*0x10;
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode & node = trace->nodes[ref];
+			if(node.op == IROpCode::seq || node.group == IRNode::FOLD)
+				stackOffset += 0x10;
+			else if(node.op == IROpCode::index)
+				stackOffset += 0x20;
+			else if(node.group == IRNode::SCAN) {
+				asm_.movq(r8, Operand(rsp, stackOffset+0x10));
+				asm_.movq(r9, Operand(rsp, stackOffset));
+				asm_.movq(EncodeOperand(node.in.raw(), r8, times_8), r9);
+				stackOffset += 0x20;
+			}
+			if(FilteredStore(node)) {
+				asm_.movq(r8, Operand(rsp, stackOffset+0x10));
+				asm_.movq(r9, Operand(rsp, stackOffset));
+				asm_.movq(EncodeOperand(node.in.raw(), r8, times_8), r9);
+				stackOffset += 0x20;
+			}
+		}
+
 		asm_.addq(rsp, Immediate(stackSpace));
 		asm_.addq(rsp, Immediate(0x8));
 		asm_.pop(rbx);
@@ -1513,6 +1632,73 @@ struct TraceJIT {
 		asm_.ret(0);
 	}
 	
+	// dense per-thread accumulators while merging them costs less than folding
+	// the vector, radix partitioning (see GlobalReduce) when there are too many
+	bool PartitionedFold(IRNode const& node) {
+		if(node.group != IRNode::FOLD || node.shape.split < 0 || node.shape.levels <= BIG_CARDINALITY)
+			return false;
+		switch(node.op) {
+			case IROpCode::prod:
+				return true;	// no dense version
+			case IROpCode::sum:
+			case IROpCode::length:
+			case IROpCode::mean:
+			case IROpCode::min:
+			case IROpCode::max:
+				return node.shape.levels * (int64_t)thread.state.threads.size() > trace->Size;
+			default:
+				return false;
+		}
+	}
+
+	// write each element's (group, value) pair for the partitioning,
+	// filtered out elements get group -1
+	void EmitPartitionStore(IRef ref) {
+		IRNode & node = trace->nodes[ref];
+		if(node.op == IROpCode::length)
+			asm_.movdqa(RegR(ref), ConstantTable(node.isInteger() ? C_INTEGER_ONE : C_DOUBLE_ONE));
+		else
+			MoveA2R(ref);
+		asm_.movapd(xmm15, RegS(ref));
+		if(node.shape.filter >= 0) {
+			asm_.pand(xmm15, RegF(ref));
+			asm_.movapd(xmm14, RegF(ref));
+			asm_.pxor(xmm14, ConstantTable(C_NOT_MASK));
+			asm_.por(xmm15, xmm14);
+		}
+		asm_.movapd(xmm14, xmm15);
+		asm_.unpcklpd(xmm14, RegR(ref));
+		asm_.unpckhpd(xmm15, RegR(ref));
+		asm_.lea(r8, Operand(vector_index, times_2, 0));
+		asm_.movdqa(EncodeOperand(node.in.raw(), r8, times_8), xmm14);
+		asm_.movdqa(EncodeOperand((char*)node.in.raw()+0x10, r8, times_8), xmm15);
+	}
+
+	bool FilteredStore(IRNode const& node) {
+		return node.liveOut && node.shape.filter >= 0 &&
+			(node.group == IRNode::MAP || node.group == IRNode::GENERATOR);
+	}
+
+	Constant ScanIdentity(IRNode const& node) {
+		switch(node.op) {
+			case IROpCode::cumsum: return node.isDouble() ? Constant(0.0) : Constant((int64_t)0);
+			case IROpCode::cumprod: return node.isDouble() ? Constant(1.0) : Constant((int64_t)1);
+			case IROpCode::cummin: return Constant(std::numeric_limits<double>::infinity());
+			case IROpCode::cummax: return Constant(-std::numeric_limits<double>::infinity());
+			default: _error("Unknown scan");
+		}
+	}
+
+	void* ScanFunction(IRNode const& node) {
+		switch(node.op) {
+			case IROpCode::cumsum: return node.isDouble() ? (void*)cumsumd : (void*)cumsumi;
+			case IROpCode::cumprod: return node.isDouble() ? (void*)cumprodd : (void*)cumprodi;
+			case IROpCode::cummin: return (void*)cummind;
+			case IROpCode::cummax: return (void*)cummaxd;
+			default: _error("Unknown scan");
+		}
+	}
+
 	XMMRegister EmitMove(XMMRegister dst, XMMRegister src) {
 		if(!dst.is(src)) {
 			asm_.movapd(dst,src);
@@ -1539,6 +1725,64 @@ struct TraceJIT {
 		}
 	}
 
+	static bool HasAVX2() {
+		static bool avx2 = __builtin_cpu_supports("avx2");
+		return avx2;
+	}
+
+	// Follows a gather's index back through integer offsets and a truncating
+	// cast to the vector it was loaded from. Returns the load, or -1 if the
+	// index is computed some other way and can't be read ahead.
+	IRef IndexLoad(IRef ref, int64_t& offset) {
+		offset = 0;
+		for(;;) {
+			IRNode const& node = trace->nodes[ref];
+			if(node.op == IROpCode::load)
+				return node.isInteger() || node.isDouble() ? ref : -1;
+			else if(node.op == IROpCode::addc && node.isInteger())
+				offset += node.constant.i;
+			else if((node.op == IROpCode::add || node.op == IROpCode::sub) && node.isInteger() &&
+					trace->nodes[node.binary.b].op == IROpCode::constant)
+				offset += (node.op == IROpCode::add ? 1 : -1) * trace->nodes[node.binary.b].constant.i;
+			else if(node.op == IROpCode::cast && node.isInteger() &&
+					trace->nodes[node.unary.a].op == IROpCode::load && trace->nodes[node.unary.a].isDouble())
+				;	// cvttsd2si truncates the same way
+			else if(node.op != IROpCode::pos)
+				return -1;
+			ref = node.unary.a;
+		}
+	}
+
+	// Random gathers are bound by cache misses. If the index comes straight
+	// from memory, read it a few iterations ahead and prefetch those elements.
+	// The read ahead is clamped to the last pair so it stays in the index vector.
+	void EmitPrefetch(IRNode const& node, void* p) {
+		int64_t distance = thread.state.epeePrefetch & ~1LL;
+		if(distance <= 0 || distance >= trace->Size)
+			return;
+		int64_t offset;
+		IRef l = IndexLoad(node.unary.a, offset);
+		if(l < 0)
+			return;
+		IRNode const& load = trace->nodes[l];
+		char* index = (char*)(load.isInteger() ? (void*)((Integer&)load.in).v() : (void*)((Double&)load.in).v()) + load.constant.i*8;
+		char* base = (char*)p + offset*8;
+
+		asm_.lea(r10, Operand(vector_index, distance));
+		asm_.movq(r11, Immediate(trace->Size-2));
+		asm_.cmpq(r10, r11);
+		asm_.cmovq(greater, r10, r11);
+		for(int lane = 0; lane < 2; lane++) {
+			if(load.isInteger()) {
+				asm_.movq(r11, EncodeOperand(index + lane*8, r10, times_8));
+			} else {
+				asm_.movsd(xmm15, EncodeOperand(index + lane*8, r10, times_8));
+				asm_.cvttsd2siq(r11, xmm15);
+			}
+			asm_.prefetch(EncodeOperand(base, r11, times_8), 1);
+		}
+	}
+
 	void EmitCall(void * fn) {
 		int64_t diff = (int64_t)(trace->code_buffer + asm_.pc_offset() + 5 - (int64_t) fn);
 		if(is_int32(diff)) {
@@ -1583,23 +1827,24 @@ struct TraceJIT {
 		else 		EmitMove(xmm1, r1);
 	}
 
-	void EmitVectorStore(IRef ref, Vector& dst, IRNode::Shape const& shape) {
+	void EmitVectorStore(IRef ref, Vector& dst, IRNode::Shape const& shape, int64_t slot) {
 		XMMRegister src = RegR(ref);
 		if(shape.filter < 0)
 			asm_.movdqa(EncodeOperand(((Double&)dst).v(),vector_index,times_8),src);
 		else {
 			XMMRegister filter = RegF(ref);
 			
+			asm_.lea(rdi, Operand(rsp, slot));
+			asm_.movq(rsi, vector_index);
 			SaveRegisters(ref);
 			Arguments2(src, filter);
-			asm_.movq(rdi,&dst);
 			EmitCall((void*)store_conditional);
 			EmitMove(RegR(ref),xmm0);
 			RestoreRegisters(ref);
 		}
 	}
 
-	void EmitLogicalStore(IRef ref, Vector& dst, IRNode::Shape const& shape) {
+	void EmitLogicalStore(IRef ref, Vector& dst, IRNode::Shape const& shape, int64_t slot) {
 		XMMRegister src = RegR(ref);
                 if(shape.filter < 0) {
 			asm_.pshufb(src,ConstantTable(C_PACK_LOGICAL));
@@ -1609,9 +1854,10 @@ struct TraceJIT {
 		} else {
 			XMMRegister filter = RegF(ref);
 			
+			asm_.lea(rdi, Operand(rsp, slot));
+			asm_.movq(rsi, vector_index);
 			SaveRegisters(ref);
 			Arguments2(src, filter);
-			asm_.movq(rdi,&dst);
 			EmitCall((void*)store_conditional_l);
 			EmitMove(RegR(ref),xmm0);
 			RestoreRegisters(ref);
@@ -1780,27 +2026,103 @@ struct TraceJIT {
 		code(thread.index, start, end);	
 	}
 
+	// each chunk folds into its own slot, whichever thread runs it
+	static void executechunk(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
+		TraceJIT const& j = *(TraceJIT const*)args;
+		fn code = (fn)j.trace->code_buffer->code;
+		uint64_t step = j.alignment == TRACE_BLOCK ? TRACE_BLOCK : end-start;
+		for(uint64_t i = start; i < end; i += step)
+			code(start/j.chunk, i, std::min(i+step, end));
+	}
+
 
 	void Compile() {
 		memset(allocated_register,-1,sizeof(char) * trace->nodes.size());
 
+		// each chunk of a scan or filtered store must be exactly one block
+		alignment = 4;
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			if(trace->nodes[ref].group == IRNode::SCAN || FilteredStore(trace->nodes[ref]))
+				alignment = TRACE_BLOCK;
+		}
+
+		// in deterministic mode the partials of folds belong to fixed chunks, not threads
+		slots = thread.state.threads.size();
+		chunk = 0;
+		if(thread.state.epeeDeterministic) {
+			int64_t width = 0;
+			for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+				IRNode const& node = trace->nodes[ref];
+				if(node.group == IRNode::FOLD && !PartitionedFold(node))
+					width += node.shape.levels*Moments::Width + 16;
+			}
+			chunk = DeterministicChunk(trace->Size, width);
+			slots = std::max((trace->Size+chunk-1)/chunk, (int64_t)1);
+		}
+
+		Balance();
 		RegisterAllocate();
 		InstructionSelection();
 	}
 
+	static bool MathCall(IROpCode::Enum op) {
+		switch(op) {
+			case IROpCode::exp: case IROpCode::log: case IROpCode::cos: case IROpCode::sin:
+			case IROpCode::tan: case IROpCode::acos: case IROpCode::asin: case IROpCode::atan:
+			case IROpCode::pow: case IROpCode::atan2: case IROpCode::hypot:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	// bytes read and written, operations and math calls for each element, and the chunks that suit them
+	void Balance() {
+		double bytes = 0, ops = 0, calls = 0;
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode const& node = trace->nodes[ref];
+			int64_t width = node.isLogical() ? 1 : 8;
+			if(node.op == IROpCode::load || node.op == IROpCode::gather)
+				bytes += width;
+			if(node.liveOut && (node.group == IRNode::MAP || node.group == IRNode::GENERATOR || node.group == IRNode::SCAN))
+				bytes += width;
+			if(MathCall(node.op))
+				calls++;
+			else if(node.group == IRNode::MAP || node.group == IRNode::FOLD || node.group == IRNode::SCAN || node.op == IROpCode::seq)
+				ops++;
+		}
+		schedule = Schedule(thread, trace->Size, bytes, ops, calls);
+		// scans and filtered stores note where each call starts, so a call can't span blocks
+		if(alignment == TRACE_BLOCK)
+			schedule.ppt = TRACE_BLOCK;
+		if(chunk > 0) {
+			schedule.threads = thread.state.threads.size();
+			schedule.ppt = chunk;
+		}
+		if(thread.state.verbose)
+			printf("trace of %lld elements, %.0f bytes, %.0f ops and %.0f calls each: %lld threads, chunks of %llu\n",
+				(long long)trace->Size, bytes, ops, calls, (long long)schedule.threads, (unsigned long long)schedule.ppt);
+	}
+
 	void Execute(Thread & thread) {
 		fn trace_code = (fn) trace->code_buffer->code;
-		if(thread.state.verbose) {
-			//timespec begin;
-			//get_time(begin);
-			thread.doall(NULL, executebody, (void*)trace_code, 0, trace->Size, 4, 1024); 
-			//trace_code(thread.index, 0, trace->length);
-			//double s = trace->length / (time_elapsed(begin) * 10e9);
-			//printf("elements computed / us: %f\n",s);
-		} else {
-			thread.doall(NULL, executebody, (void*)trace_code, 0, trace->Size, 4, 1024); 
-			//trace_code(thread.index, 0, trace->length);
-		}
+		if(chunk > 0)
+			thread.doall(NULL, executechunk, this, 0, trace->Size, chunk, chunk);
+		else
+			thread.doall(NULL, executebody, (void*)trace_code, 0, trace->Size, alignment, schedule.ppt); 
+	}
+
+	void Launch(Thread & thread) {
+		fn trace_code = (fn) trace->code_buffer->code;
+		if(chunk > 0)
+			done = thread.spawn(NULL, executechunk, this, 0, trace->Size, chunk, chunk);
+		else
+			done = thread.spawn(NULL, executebody, (void*)trace_code, 0, trace->Size, alignment, schedule.ppt);
+	}
+
+	void Join(Thread & thread) {
+		thread.join(done);
+		done = 0;
 	}
 
 	void mergeMin(IRNode& node, int64_t i, int64_t j) {
@@ -1812,9 +2134,9 @@ struct TraceJIT {
 	
 	void mergeMax(IRNode& node, int64_t i, int64_t j) {
 		if(node.isDouble())
-			((Double&)node.in)[i] = std::max(((Double&)node.in)[i], ((double*)node.in.p)[j]);
+			((Double&)node.in)[i] = std::max(((Double&)node.in)[i], ((Double&)node.in)[j]);
 		else
-			((Integer&)node.in)[i] = std::max(((Integer&)node.in)[i], ((int64_t*)node.in.p)[j]);
+			((Integer&)node.in)[i] = std::max(((Integer&)node.in)[i], ((Integer&)node.in)[j]);
 	}
 	
 	// merge value in j into i
@@ -1879,89 +2201,324 @@ struct TraceJIT {
 		}
 	}
 
+	// one merge of every thread's (or chunk's) state, then the statistics of each group
+	void MergeMoments(IRNode& node) {
+		double* acc = ((Double&)node.in).v();
+		int64_t stride = node.in.length() / slots;
+		Double out(node.outShape.length);
+		for(int64_t g = 0; g < node.shape.levels; g++) {
+			if(chunk == 0) {
+				for(int64_t t = 1; t < slots; t++)
+					Moments::merge(acc + g*Moments::Width, acc + t*stride + g*Moments::Width);
+			} else {
+				for(int64_t s = 1; s < slots; s *= 2)
+					for(int64_t j = 0; j+s < slots; j += 2*s)
+						Moments::merge(acc + j*stride + g*Moments::Width, acc + (j+s)*stride + g*Moments::Width);
+			}
+			Moments::result(acc + g*Moments::Width, out.v() + g*Moments::Stats);
+		}
+		node.out = out;
+	}
+
+	struct Compaction {
+		char const* src;
+		int64_t width;
+		int64_t length;
+		int64_t size;
+		int64_t const* offsets;
+		char* dst;
+	};
+
+	// copy blocks [start, end) of a filtered store to their place in the result
+	static void compact(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+		Compaction const& c = *(Compaction const*)args;
+		for(uint64_t b = start; b < end; b++) {
+			int64_t next = (int64_t)b+1 < (c.size+TRACE_BLOCK-1)/TRACE_BLOCK ? c.offsets[b+1] : c.length;
+			memcpy(c.dst + c.offsets[b]*c.width, 
+				c.src + b*TRACE_BLOCK*c.width, 
+				(next-c.offsets[b])*c.width);
+		}
+	}
+
+	struct Partitioning {
+		IROpCode::Enum op;
+		Type::Enum type;
+		int64_t const* pairs;
+		int64_t size;
+		int64_t levels;
+		int64_t shift;
+		int64_t partitions;
+		int64_t chunk;
+		int64_t* offsets;	// chunks x partitions, where each chunk writes in each partition
+		int64_t const* starts;	// partitions+1
+		int64_t* sorted;
+		void* out;
+	};
+
+	// count the groups of chunks [start, end) that fall in each partition
+	static void histogram(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+		Partitioning const& p = *(Partitioning const*)args;
+		for(uint64_t c = start; c < end; c++) {
+			int64_t* counts = p.offsets + c*p.partitions;
+			int64_t last = std::min((int64_t)(c+1)*p.chunk, p.size);
+			for(int64_t i = c*p.chunk; i < last; i++) {
+				uint64_t group = p.pairs[2*i];
+				if(group < (uint64_t)p.levels)
+					counts[group >> p.shift]++;
+			}
+		}
+	}
+
+	// move the pairs of chunks [start, end) to their partitions, keeping them in order
+	static void scatter(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+		Partitioning const& p = *(Partitioning const*)args;
+		for(uint64_t c = start; c < end; c++) {
+			int64_t* offsets = p.offsets + c*p.partitions;
+			int64_t last = std::min((int64_t)(c+1)*p.chunk, p.size);
+			for(int64_t i = c*p.chunk; i < last; i++) {
+				uint64_t group = p.pairs[2*i];
+				if(group < (uint64_t)p.levels) {
+					int64_t o = offsets[group >> p.shift]++;
+					p.sorted[2*o] = p.pairs[2*i];
+					p.sorted[2*o+1] = p.pairs[2*i+1];
+				}
+			}
+		}
+	}
+
+	template<typename T>
+	static void aggregate(Partitioning const& p, int64_t partition) {
+		int64_t base = partition << p.shift;
+		int64_t width = std::min((int64_t)1 << p.shift, p.levels - base);
+		T* out = (T*)p.out + base;
+		T init = 0;
+		if(p.op == IROpCode::prod)
+			init = 1;
+		else if(p.op == IROpCode::min)
+			init = std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+		else if(p.op == IROpCode::max)
+			init = std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::min();
+		for(int64_t k = 0; k < width; k++)
+			out[k] = init;
+		std::vector<int64_t> n(p.op == IROpCode::mean ? width : 0, 0);
+
+		for(int64_t j = p.starts[partition]; j < p.starts[partition+1]; j++) {
+			int64_t k = p.sorted[2*j] - base;
+			T v;
+			memcpy(&v, &p.sorted[2*j+1], sizeof(T));
+			switch(p.op) {
+				case IROpCode::sum:
+				case IROpCode::length: out[k] += v; break;
+				case IROpCode::prod: out[k] *= v; break;
+				case IROpCode::min: out[k] = std::min(out[k], v); break;
+				case IROpCode::max: out[k] = std::max(out[k], v); break;
+				case IROpCode::mean: out[k] += (v - out[k]) / ++n[k]; break;
+				default: break;
+			}
+		}
+		if(p.op == IROpCode::mean) {
+			for(int64_t k = 0; k < width; k++)
+				if(n[k] == 0) out[k] = std::numeric_limits<T>::quiet_NaN();
+		}
+	}
+
+	// aggregate partitions [start, end) into their slices of the result
+	static void aggregate(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+		Partitioning const& p = *(Partitioning const*)args;
+		for(uint64_t i = start; i < end; i++) {
+			if(p.type == Type::Double)
+				aggregate<double>(p, i);
+			else
+				aggregate<int64_t>(p, i);
+		}
+	}
+
+	// merge partial j of a fold into partial i
+	void merge(IRNode& node, int64_t i, int64_t j) {
+		switch(node.op) {
+			case IROpCode::sum: 
+				mergeSum(node, i, j);
+				break;
+			case IROpCode::prod:
+				mergeProd(node, i, j);
+				break;
+			case IROpCode::length:
+				mergeLength(node, i, j);
+				break;
+			case IROpCode::mean:
+				mergeMean(node, i, j);
+				break;
+			case IROpCode::cm2:
+				mergeCm2(node, i, j);
+				break;
+			case IROpCode::min:
+				mergeMin(node, i, j);
+				break;
+			case IROpCode::max:
+				mergeMax(node, i, j);
+				break;
+			default: /* do nothing */ break;
+		}
+	}
+
 	void GlobalReduce(Thread& thread) {
 		// merge across vector lanes
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
 
 			if(node.group == IRNode::FOLD && node.outShape.length <= BIG_CARDINALITY) {
-				int64_t step = node.in.length()/thread.state.threads.size();
-
-				for(uint64_t j = 0; j < thread.state.threads.size(); j++) {
-					for(int64_t i = 0; i < node.outShape.length; i++) {
-						int64_t a = j*step+i*2;
-						int64_t b = j*step+i*2+1;
-
-						switch(node.op) {
-							case IROpCode::sum: 
-								mergeSum(node, a, b);
-								break;
-							case IROpCode::prod:
-								mergeProd(node, a, b);
-								break;
-							case IROpCode::length:
-								mergeLength(node, a, b);
-								break;
-							case IROpCode::mean:
-								mergeMean(node, a, b);
-								break;
-							case IROpCode::cm2:
-								mergeCm2(node, a, b);
-								break;
-							case IROpCode::min:
-								mergeMin(node, a, b);
-								break;
-							case IROpCode::max:
-								mergeMax(node, a, b);
-								break;
-							default: // do nothing
-								break;
+				int64_t step = node.in.length()/slots;
+
+				for(int64_t j = 0; j < slots; j++) {
+					for(int64_t i = 0; i < node.outShape.length; i++)
+						merge(node, j*step+i*2, j*step+i*2+1);
+				}
+			}
+		}
+
+		// merge across threads
+		if(chunk == 0) {
+			for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+				IRNode & node = trace->nodes[ref];
+		
+				if(node.group == IRNode::FOLD && !PartitionedFold(node)) {
+					int64_t step = node.in.length()/slots;
+					// the lanes were merged into the even slots above
+					int64_t stride = node.outShape.length <= BIG_CARDINALITY ? 2 : 1;
+					for(int64_t j = 1; j < slots; j++) {
+						for(int64_t i = 0; i < node.outShape.length; i++)
+							merge(node, i*stride, j*step+i*stride);
+					}
+				}
+			}
+		}
+		// or pairwise across chunks, always in the same tree. Every fold merges
+		// a pair before the next pair, since means and cm2 use the merged lengths.
+		else {
+			for(int64_t s = 1; s < slots; s *= 2) {
+				for(int64_t j = 0; j+s < slots; j += 2*s) {
+					for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+						IRNode & node = trace->nodes[ref];
+						if(node.group == IRNode::FOLD && !PartitionedFold(node)) {
+							int64_t step = node.in.length()/slots;
+							int64_t stride = node.outShape.length <= BIG_CARDINALITY ? 2 : 1;
+							for(int64_t i = 0; i < node.outShape.length; i++)
+								merge(node, j*step+i*stride, (j+s)*step+i*stride);
 						}
 					}
 				}
 			}
 		}
 
-		// merge across threads
+		// propagate the block totals of scans and fix up all but the first block
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
-	
-			if(node.group == IRNode::FOLD) {
-				int64_t step = node.in.length()/thread.state.threads.size();
-				for(uint64_t j = 1; j < thread.state.threads.size(); j++) {
-					for(int64_t i = 0; i < node.outShape.length; i++) {
-						int64_t a = 0*step+i;
-						int64_t b = j*step+i;
-						switch(node.op) {
-							case IROpCode::sum: 
-								mergeSum(node, a, b);
-								break;
-							case IROpCode::prod:
-								mergeProd(node, a, b);
-								break;
-							case IROpCode::length:
-								mergeLength(node, a, b);
-								break;
-							case IROpCode::mean:
-								mergeMean(node, a, b);
-								break;
-							case IROpCode::cm2:
-								mergeCm2(node, a, b);
-								break;
-							case IROpCode::min:
-								mergeMin(node, a, b);
-								break;
-							case IROpCode::max:
-								mergeMax(node, a, b);
-								break;
-							default: /* do nothing */ break;
-						}
+
+			if(node.group == IRNode::SCAN && node.liveOut) {
+				Thread::Task::FunctionPtr fixup = 0;
+				switch(node.op) {
+					case IROpCode::cumsum:
+						if(node.isDouble()) { cumsumd_carry(node, 0.0); fixup = cumsumd_fixup; }
+						else { cumsumi_carry(node, 0); fixup = cumsumi_fixup; }
+						break;
+					case IROpCode::cumprod:
+						if(node.isDouble()) { cumprodd_carry(node, 1.0); fixup = cumprodd_fixup; }
+						else { cumprodi_carry(node, 1); fixup = cumprodi_fixup; }
+						break;
+					case IROpCode::cummin:
+						cummind_carry(node, std::numeric_limits<double>::infinity()); 
+						fixup = cummind_fixup;
+						break;
+					case IROpCode::cummax:
+						cummaxd_carry(node, -std::numeric_limits<double>::infinity()); 
+						fixup = cummaxd_fixup;
+						break;
+					default: _error("Unknown scan"); break;
+				}
+				thread.doall(NULL, fixup, &node, TRACE_BLOCK, trace->Size, TRACE_BLOCK, TRACE_BLOCK);
+			}
+		}
+
+		// partition the pairs of big group-bys on the high bits of their group,
+		// then aggregate each partition into its own part of the result
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode & node = trace->nodes[ref];
+
+			if(PartitionedFold(node) && node.liveOut) {
+				int64_t levels = node.outShape.length;
+				int64_t threads = thread.state.threads.size();
+
+				// partitions span at least 2^PARTITION_BITS groups, fewer
+				// when short vectors wouldn't fill them
+				int64_t partitions = std::min(std::max(trace->Size >> 8, (int64_t)1), (int64_t)MAX_PARTITIONS);
+				int64_t shift = PARTITION_BITS;
+				while(((levels-1) >> shift) >= partitions)
+					shift++;
+				partitions = ((levels-1) >> shift) + 1;
+
+				int64_t chunks = std::min(threads*4, (trace->Size+TRACE_BLOCK-1)/TRACE_BLOCK);
+				int64_t chunk = (trace->Size+chunks-1)/chunks;
+
+				std::vector<int64_t> offsets(chunks*partitions, 0);
+				std::vector<int64_t> starts(partitions+1, 0);
+
+				Partitioning p = { node.op, node.type, (int64_t const*)node.in.raw(), trace->Size, 
+					levels, shift, partitions, chunk, &offsets[0], &starts[0], 0, node.out.raw() };
+				thread.doall(NULL, histogram, &p, 0, chunks, 1, 1);
+
+				// partition major, so each partition keeps the elements in order
+				int64_t total = 0;
+				for(int64_t i = 0; i < partitions; i++) {
+					starts[i] = total;
+					for(int64_t c = 0; c < chunks; c++) {
+						int64_t count = offsets[c*partitions+i];
+						offsets[c*partitions+i] = total;
+						total += count;
 					}
 				}
+				starts[partitions] = total;
+
+				std::vector<int64_t> sorted(std::max(total*2, (int64_t)1));
+				p.sorted = &sorted[0];
+				thread.doall(NULL, scatter, &p, 0, chunks, 1, 1);
+				thread.doall(NULL, aggregate, &p, 0, partitions, 1, 1);
 			}
 		}
 
-		// TODO: merge filtered vectors!
+		// pack the blocks of filtered stores together
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode & node = trace->nodes[ref];
+
+			if(FilteredStore(node)) {
+				int64_t blocks = (trace->Size+TRACE_BLOCK-1)/TRACE_BLOCK;
+				int64_t width = node.isLogical() ? 1 : 8;
+				char* src = (char*)node.out.raw();
+				int64_t* ends = (int64_t*)node.in.raw();
+				
+				// turn the end of each block into its offset in the result
+				int64_t length = 0;
+				for(int64_t b = 0; b < blocks; b++) {
+					int64_t count = (ends[b] - (int64_t)(src + b*TRACE_BLOCK*width)) / width;
+					ends[b] = length;
+					length += count;
+				}
+
+				Vector result;
+				if(node.type == Type::Double)
+					result = Double(length);
+				else if(node.type == Type::Integer)
+					result = Integer(length);
+				else if(node.type == Type::Logical)
+					result = Logical(length);
+				else
+					_error("Unknown type in filtered store");
+
+				Compaction c = { src, width, length, trace->Size, ends, 
+					node.isLogical() ? (char*)((Logical&)result).v() : (char*)((Double&)result).v() };
+				thread.doall(NULL, compact, &c, 0, blocks, 1, 16);
+				node.out = result;
+			}
+		}
 
 		// copy to output vector
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
@@ -1978,26 +2535,27 @@ struct TraceJIT {
 					trace->nodes[node.binary.b].out, 
 					node.out);
 			}
-			else if(node.group == IRNode::FOLD) {
-				if(node.shape.levels <= BIG_CARDINALITY) {
-					if(node.isDouble()) {
-						Double& d = (Double&)node.out;
-						for(int64_t i = 0, j = 0; i < node.outShape.length; i++, j+=2) {
-							d[i] = ((Double&)node.in)[j];
-						}
-					}
-					else if(node.isInteger()) {
-						Integer& d = (Integer&)node.out;
-						for(int64_t i = 0, j = 0; i < node.outShape.length; i++, j+=2) {
-							d[i] = ((Integer&)node.in)[j];
-						}
+			else if(node.op == IROpCode::moments) {
+				MergeMoments(node);
+			}
+			else if(node.group == IRNode::FOLD && !PartitionedFold(node) && 
+					(node.liveOut || node.outShape.length <= BIG_CARDINALITY)) {
+				// the lanes were merged into the even slots, or share one if there are many groups
+				int64_t stride = node.shape.levels <= BIG_CARDINALITY ? 2 : 1;
+				if(node.isDouble()) {
+					Double& d = (Double&)node.out;
+					for(int64_t i = 0, j = 0; i < node.outShape.length; i++, j+=stride) {
+						d[i] = ((Double&)node.in)[j];
 					}
-					else {
-						_error("NYI");
+				}
+				else if(node.isInteger()) {
+					Integer& d = (Integer&)node.out;
+					for(int64_t i = 0, j = 0; i < node.outShape.length; i++, j+=stride) {
+						d[i] = ((Integer&)node.in)[j];
 					}
 				}
 				else {
-					node.out = node.in;
+					_error("NYI");
 				}
 			}
 		}
@@ -2009,8 +2567,48 @@ void Trace::JIT(Thread & thread) {
 		code_buffer = new TraceCodeBuffer();
 	}
 
+	timespec begin = get_time();
+	CalibrateMachine(thread);
 	TraceJIT trace_code(this, thread);
 	trace_code.Compile();
+	if(thread.state.perf != State::PerfNone)
+		Announce(thread, code_buffer->code, trace_code.asm_.pc_offset(), trace_code.offsets);
+	spills = trace_code.spilled;
+	setup += time_elapsed(begin);
 	trace_code.Execute(thread);
 	trace_code.GlobalReduce(thread);
 }
+
+void Trace::JITLaunch(Thread & thread) {
+	if(code_buffer == NULL) {
+		code_buffer = new TraceCodeBuffer();
+	}
+
+	timespec begin = get_time();
+	CalibrateMachine(thread);
+	launched = new TraceJIT(this, thread);
+	launched->Compile();
+	if(thread.state.perf != State::PerfNone)
+		Announce(thread, code_buffer->code, launched->asm_.pc_offset(), launched->offsets);
+	spills = launched->spilled;
+	setup += time_elapsed(begin);
+
+	// the GC doesn't know about traces, so hold on to everything the running code touches
+	for(size_t i = 0; i < nodes.size(); i++) {
+		IRNode const& node = nodes[i];
+		if(node.op == IROpCode::load || node.op == IROpCode::gather || node.group == IRNode::FOLD || node.group == IRNode::SCAN)
+			roots.push_back(node.in);
+		if(node.liveOut || (node.group == IRNode::FOLD && node.outShape.length <= BIG_CARDINALITY))
+			roots.push_back(node.out);
+	}
+
+	started = get_time();
+	launched->Launch(thread);
+}
+
+void Trace::JITJoin(Thread & thread) {
+	launched->Join(thread);
+	launched->GlobalReduce(thread);
+	delete launched;
+	launched = NULL;
+}
@@ -0,0 +1,879 @@
+
+#include <algorithm>
+#include <emmintrin.h>
+
+#include "../interpreter.h"
+#include "../vector.h"
+#include "../ops.h"
+#include "../runtime.h"
+#include "../random.h"
+#include "moments.h"
+
+// A portable alternative to the JIT. Every thread walks the fused trace once
+// per block of TRACE_BLOCK elements, running each node over the whole block
+// with the scalar interpreter's kernels. A block of each live node fits in
+// cache, so the trace is still a single pass over its inputs and outputs.
+
+static int64_t Width(Type::Enum type) {
+	return type == Type::Logical ? 1 : 8;
+}
+
+template<class Op>
+static void Unary(Thread& thread, Type::Enum type, void const* a, void* r, int64_t n) {
+	if(Op::R::ValueType != type) _error("Unexpected result type in block interpreter");
+	typename Op::A::Element const* ae = (typename Op::A::Element const*)a;
+	typename Op::R::Element* re = (typename Op::R::Element*)r;
+	if(n == TRACE_BLOCK)
+		Map1<Op,TRACE_BLOCK>::eval(thread, ae, re);
+	else
+		for(int64_t i = 0; i < n; i++) Map1<Op,1>::eval(thread, ae+i, re+i);
+}
+
+template<class Op>
+static void Binary(Thread& thread, Type::Enum type, void const* a, void const* b, void* r, int64_t n) {
+	if(Op::R::ValueType != type) _error("Unexpected result type in block interpreter");
+	typename Op::A::Element const* ae = (typename Op::A::Element const*)a;
+	typename Op::B::Element const* be = (typename Op::B::Element const*)b;
+	typename Op::R::Element* re = (typename Op::R::Element*)r;
+	if(n == TRACE_BLOCK)
+		Map2VV<Op,TRACE_BLOCK>::eval(thread, ae, be, re);
+	else
+		for(int64_t i = 0; i < n; i++) Map2VV<Op,1>::eval(thread, ae+i, be+i, re+i);
+}
+
+template<class Op>
+static void BinaryConstant(Thread& thread, void const* a, typename Op::B::Element b, void* r, int64_t n) {
+	typename Op::A::Element const* ae = (typename Op::A::Element const*)a;
+	typename Op::R::Element* re = (typename Op::R::Element*)r;
+	if(n == TRACE_BLOCK)
+		Map2VS<Op,TRACE_BLOCK>::eval(thread, ae, b, re);
+	else
+		for(int64_t i = 0; i < n; i++) Map2VS<Op,1>::eval(thread, ae+i, b, re+i);
+}
+
+template< template<class X> class Op >
+static void UnaryDispatch(Thread& thread, Type::Enum type, Type::Enum ta, void const* a, void* r, int64_t n) {
+	switch(ta) {
+		case Type::Double: Unary< Op<Double> >(thread, type, a, r, n); break;
+		case Type::Integer: Unary< Op<Integer> >(thread, type, a, r, n); break;
+		case Type::Logical: Unary< Op<Logical> >(thread, type, a, r, n); break;
+		default: _error("Unexpected type in block interpreter");
+	}
+}
+
+template< template<class X, class Y> class Op, class A >
+static void BinaryDispatch(Thread& thread, Type::Enum type, Type::Enum tb, void const* a, void const* b, void* r, int64_t n) {
+	switch(tb) {
+		case Type::Double: Binary< Op<A, Double> >(thread, type, a, b, r, n); break;
+		case Type::Integer: Binary< Op<A, Integer> >(thread, type, a, b, r, n); break;
+		case Type::Logical: Binary< Op<A, Logical> >(thread, type, a, b, r, n); break;
+		default: _error("Unexpected type in block interpreter");
+	}
+}
+
+template< template<class X, class Y> class Op >
+static void BinaryDispatch(Thread& thread, Type::Enum type, Type::Enum ta, Type::Enum tb, void const* a, void const* b, void* r, int64_t n) {
+	switch(ta) {
+		case Type::Double: BinaryDispatch<Op, Double>(thread, type, tb, a, b, r, n); break;
+		case Type::Integer: BinaryDispatch<Op, Integer>(thread, type, tb, a, b, r, n); break;
+		case Type::Logical: BinaryDispatch<Op, Logical>(thread, type, tb, a, b, r, n); break;
+		default: _error("Unexpected type in block interpreter");
+	}
+}
+
+template<class T>
+static void Gather(T const& in, int64_t const* index, void* r, int64_t n) {
+	typename T::Element const* src = (typename T::Element const*)in.raw();
+	typename T::Element* dst = (typename T::Element*)r;
+	int64_t length = in.length();
+	for(int64_t i = 0; i < n; i++)
+		dst[i] = (index[i] >= 0 && index[i] < length) ? src[index[i]] : T::NAelement;
+}
+
+template<class T>
+static void Select(char const* c, void const* a, void const* b, void* r, int64_t n) {
+	typename T::Element const* ae = (typename T::Element const*)a;
+	typename T::Element const* be = (typename T::Element const*)b;
+	typename T::Element* re = (typename T::Element*)r;
+	for(int64_t i = 0; i < n; i++)
+		re[i] = Logical::isTrue(c[i]) ? be[i] : Logical::isFalse(c[i]) ? ae[i] : T::NAelement;
+}
+
+// Folds keep an accumulator per group for every thread (or chunk) in node.in,
+// (width elements a group) and are merged once all the blocks are done.
+struct FoldFunctions {
+	void (*init)(Vector& in, int64_t length);
+	void (*fold)(Thread& thread, void* acc, void const* a, void const* b, char const* f, int64_t const* s, int64_t levels, int64_t n);
+	void (*merge)(Thread& thread, void* acc, void const* other, int64_t levels);
+	void (*result)(void const* acc, int64_t levels, Vector& out);
+	int64_t width;
+};
+
+template<class Op>
+struct Reduction {
+	typedef typename Op::R R;
+	typedef typename R::Element E;
+	static const int64_t width = 1;
+
+	static void init(Vector& in, int64_t length) {
+		R r(length);
+		for(int64_t i = 0; i < length; i++) r[i] = Op::base();
+		in = r;
+	}
+
+	static void fold(Thread& thread, void* acc, void const* a, void const* b, char const* f, int64_t const* s, int64_t levels, int64_t n) {
+		E* r = (E*)acc;
+		typename Op::B::Element const* ae = (typename Op::B::Element const*)a;
+		if(f == 0 && s == 0) {
+			E v = r[0];
+			for(int64_t i = 0; i < n; i++) v = Op::eval(thread, v, ae[i]);
+			r[0] = v;
+		} else {
+			for(int64_t i = 0; i < n; i++) {
+				int64_t g = s != 0 ? s[i] : 0;
+				if((f == 0 || Logical::isTrue(f[i])) && g >= 0 && g < levels)
+					r[g] = Op::eval(thread, r[g], ae[i]);
+			}
+		}
+	}
+
+	static void merge(Thread& thread, void* acc, void const* other, int64_t levels) {
+		E* r = (E*)acc;
+		E const* o = (E const*)other;
+		for(int64_t g = 0; g < levels; g++) r[g] = Op::eval(thread, r[g], o[g]);
+	}
+
+	static void result(void const* acc, int64_t levels, Vector& out) {
+		E const* r = (E const*)acc;
+		R o(levels);
+		for(int64_t g = 0; g < levels; g++) o[g] = r[g];
+		out = o;
+	}
+};
+
+template<class R>
+struct Count {
+	typedef typename R::Element E;
+	static const int64_t width = 1;
+
+	static void init(Vector& in, int64_t length) {
+		R r(length);
+		for(int64_t i = 0; i < length; i++) r[i] = 0;
+		in = r;
+	}
+
+	static void fold(Thread& thread, void* acc, void const* a, void const* b, char const* f, int64_t const* s, int64_t levels, int64_t n) {
+		E* r = (E*)acc;
+		for(int64_t i = 0; i < n; i++) {
+			int64_t g = s != 0 ? s[i] : 0;
+			if((f == 0 || Logical::isTrue(f[i])) && g >= 0 && g < levels)
+				r[g] += 1;
+		}
+	}
+
+	static void merge(Thread& thread, void* acc, void const* other, int64_t levels) {
+		E* r = (E*)acc;
+		E const* o = (E const*)other;
+		for(int64_t g = 0; g < levels; g++) r[g] += o[g];
+	}
+
+	static void result(void const* acc, int64_t levels, Vector& out) {
+		E const* r = (E const*)acc;
+		R o(levels);
+		for(int64_t g = 0; g < levels; g++) o[g] = r[g];
+		out = o;
+	}
+};
+
+// (n, mean) for each group, updated with Welford's method
+struct Mean {
+	static const int64_t width = 2;
+
+	static void init(Vector& in, int64_t length) {
+		Double r(length);
+		for(int64_t i = 0; i < length; i++) r[i] = 0;
+		in = r;
+	}
+
+	static void fold(Thread& thread, void* acc, void const* a, void const* b, char const* f, int64_t const* s, int64_t levels, int64_t n) {
+		double* r = (double*)acc;
+		double const* x = (double const*)a;
+		for(int64_t i = 0; i < n; i++) {
+			int64_t g = s != 0 ? s[i] : 0;
+			if((f == 0 || Logical::isTrue(f[i])) && g >= 0 && g < levels) {
+				double* m = r + g*2;
+				m[0] += 1;
+				m[1] += (x[i] - m[1]) / m[0];
+			}
+		}
+	}
+
+	static void merge(Thread& thread, void* acc, void const* other, int64_t levels) {
+		for(int64_t g = 0; g < levels; g++) {
+			double* m = (double*)acc + g*2;
+			double const* m2 = (double const*)other + g*2;
+			if(m2[0] > 0) {
+				m[0] += m2[0];
+				m[1] += (m2[1] - m[1]) * m2[0] / m[0];
+			}
+		}
+	}
+
+	static void result(void const* acc, int64_t levels, Vector& out) {
+		Double o(levels);
+		for(int64_t g = 0; g < levels; g++) o[g] = ((double const*)acc)[g*2+1];
+		out = o;
+	}
+};
+
+// (n, mean of a, mean of b, co-moment) for each group
+struct Moment2 {
+	static const int64_t width = 4;
+
+	static void init(Vector& in, int64_t length) {
+		Double r(length);
+		for(int64_t i = 0; i < length; i++) r[i] = 0;
+		in = r;
+	}
+
+	static void fold(Thread& thread, void* acc, void const* a, void const* b, char const* f, int64_t const* s, int64_t levels, int64_t n) {
+		double* r = (double*)acc;
+		double const* x = (double const*)a;
+		double const* y = (double const*)b;
+		for(int64_t i = 0; i < n; i++) {
+			int64_t g = s != 0 ? s[i] : 0;
+			if((f == 0 || Logical::isTrue(f[i])) && g >= 0 && g < levels) {
+				double* m = r + g*4;
+				m[0] += 1;
+				double dx = x[i] - m[1];
+				m[1] += dx / m[0];
+				m[2] += (y[i] - m[2]) / m[0];
+				m[3] += dx * (y[i] - m[2]);
+			}
+		}
+	}
+
+	static void merge(Thread& thread, void* acc, void const* other, int64_t levels) {
+		for(int64_t g = 0; g < levels; g++) {
+			double* m = (double*)acc + g*4;
+			double const* m2 = (double const*)other + g*4;
+			if(m2[0] > 0) {
+				double n = m[0] + m2[0];
+				double dx = m2[1] - m[1];
+				double dy = m2[2] - m[2];
+				m[3] += m2[3] + dx * dy * m[0] * m2[0] / n;
+				m[1] += dx * m2[0] / n;
+				m[2] += dy * m2[0] / n;
+				m[0] = n;
+			}
+		}
+	}
+
+	static void result(void const* acc, int64_t levels, Vector& out) {
+		Double o(levels);
+		for(int64_t g = 0; g < levels; g++) o[g] = ((double const*)acc)[g*4+3];
+		out = o;
+	}
+};
+
+// all of moments() for each group, see moments.h
+struct Summary {
+	static const int64_t width = Moments::Width;
+
+	static void init(Vector& in, int64_t length) {
+		Double r(length);
+		for(int64_t i = 0; i+width <= length; i += width) Moments::init(r.v()+i);
+		in = r;
+	}
+
+	static void fold(Thread& thread, void* acc, void const* a, void const* b, char const* f, int64_t const* s, int64_t levels, int64_t n) {
+		double* r = (double*)acc;
+		double const* x = (double const*)a;
+		for(int64_t i = 0; i < n; i++) {
+			int64_t g = s != 0 ? s[i] : 0;
+			if((f == 0 || Logical::isTrue(f[i])) && g >= 0 && g < levels)
+				Moments::add(r + g*width, x[i]);
+		}
+	}
+
+	static void merge(Thread& thread, void* acc, void const* other, int64_t levels) {
+		for(int64_t g = 0; g < levels; g++)
+			Moments::merge((double*)acc + g*width, (double const*)other + g*width);
+	}
+
+	static void result(void const* acc, int64_t levels, Vector& out) {
+		Double o(levels*Moments::Stats);
+		for(int64_t g = 0; g < levels; g++)
+			Moments::result((double const*)acc + g*width, o.v() + g*Moments::Stats);
+		out = o;
+	}
+};
+
+template<class Op>
+static FoldFunctions FoldEntry() {
+	FoldFunctions f = { Op::init, Op::fold, Op::merge, Op::result, Op::width };
+	return f;
+}
+
+static FoldFunctions FoldFor(IRNode const& node) {
+	switch(node.op) {
+		#define FOLD_CASE(Name, String, Group, Func) \
+		case IROpCode::Name: \
+			if(node.isDouble()) return FoldEntry< Reduction< Name##VOp<Double> > >(); \
+			else if(node.isInteger()) return FoldEntry< Reduction< Name##VOp<Integer> > >(); \
+			else if(node.isLogical()) return FoldEntry< Reduction< Name##VOp<Logical> > >(); \
+			break;
+		ARITH_FOLD_BYTECODES(FOLD_CASE)
+		LOGICAL_FOLD_BYTECODES(FOLD_CASE)
+		UNIFY_FOLD_BYTECODES(FOLD_CASE)
+		#undef FOLD_CASE
+		case IROpCode::length:
+			if(node.isDouble()) return FoldEntry< Count<Double> >();
+			else if(node.isInteger()) return FoldEntry< Count<Integer> >();
+			break;
+		case IROpCode::mean:
+			return FoldEntry<Mean>();
+		case IROpCode::cm2:
+			return FoldEntry<Moment2>();
+		case IROpCode::moments:
+			return FoldEntry<Summary>();
+		default:
+			break;
+	}
+	_error("Unsupported fold in block interpreter");
+}
+
+// Scans are done in each block starting from the identity,
+// then the block totals are propagated and added to all but the first block.
+struct ScanFunctions {
+	void (*scan)(Thread& thread, void const* a, void* r, void* total, int64_t n);
+	void (*carry)(Thread& thread, Vector& totals);
+	void (*fixup)(Thread& thread, void const* carry, void* r, int64_t n);
+};
+
+template<class Op>
+struct Prefix {
+	typedef typename Op::R::Element E;
+
+	static void scan(Thread& thread, void const* a, void* r, void* total, int64_t n) {
+		typename Op::B::Element const* ae = (typename Op::B::Element const*)a;
+		E* re = (E*)r;
+		E v = Op::base();
+		for(int64_t i = 0; i < n; i++) re[i] = v = Op::eval(thread, v, ae[i]);
+		*(E*)total = v;
+	}
+
+	static void carry(Thread& thread, Vector& totals) {
+		E* t = (E*)totals.raw();
+		E v = Op::base();
+		for(int64_t b = 0; b < totals.length(); b++) {
+			E next = Op::eval(thread, v, t[b]);
+			t[b] = v;
+			v = next;
+		}
+	}
+
+	static void fixup(Thread& thread, void const* carry, void* r, int64_t n) {
+		E c = *(E const*)carry;
+		E* re = (E*)r;
+		for(int64_t i = 0; i < n; i++) re[i] = Op::eval(thread, c, re[i]);
+	}
+};
+
+template<class Op>
+static ScanFunctions ScanEntry() {
+	ScanFunctions f = { Prefix<Op>::scan, Prefix<Op>::carry, Prefix<Op>::fixup };
+	return f;
+}
+
+static ScanFunctions ScanFor(IRNode const& node) {
+	switch(node.op) {
+		#define SCAN_CASE(Name, String, Group, Func) \
+		case IROpCode::Name: \
+			if(node.isDouble()) return ScanEntry< Name##VOp<Double> >(); \
+			else if(node.isInteger()) return ScanEntry< Name##VOp<Integer> >(); \
+			break;
+		ARITH_SCAN_BYTECODES(SCAN_CASE)
+		UNIFY_SCAN_BYTECODES(SCAN_CASE)
+		#undef SCAN_CASE
+		default:
+			break;
+	}
+	_error("Unsupported scan in block interpreter");
+}
+
+static Vector Allocate(Type::Enum type, int64_t length) {
+	switch(type) {
+		case Type::Double: return Double(length);
+		case Type::Integer: return Integer(length);
+		case Type::Logical: return Logical(length);
+		default: _error("Unknown type in initialize outputs");
+	}
+}
+
+// element i of src as a length 1 vector (which is packed, so raw() can't be written)
+static Vector Single(Type::Enum type, void const* src, int64_t i) {
+	switch(type) {
+		case Type::Double: return Double::c(((Double::Element const*)src)[i]);
+		case Type::Integer: return Integer::c(((Integer::Element const*)src)[i]);
+		case Type::Logical: return Logical::c(((Logical::Element const*)src)[i]);
+		default: _error("Unknown type in initialize outputs");
+	}
+}
+
+struct TraceInterpreter {
+	Trace* trace;
+	std::vector<IRNode>& nodes;
+	int64_t threads;
+	int64_t blocks;
+
+	std::vector<bool> skipped;	// running values of a fold, only meaningful to the JIT
+	std::vector<IRef> source;	// node whose values each node shares (itself if it computes its own)
+	std::vector<int64_t> slot;	// block of each node in a thread's scratch space, -1 if it has none
+	int64_t slots;
+	std::vector<double> scratch;
+	std::vector<double> constants;
+	std::vector<int64_t> constant;	// block of each constant
+
+	std::vector<FoldFunctions> folds;
+	std::vector<int64_t> stride;	// accumulator elements per thread (or chunk)
+	int64_t partials;	// accumulators each fold keeps, one per thread or per chunk
+	int64_t chunk;	// elements folded into each accumulator in deterministic mode, otherwise 0
+	std::vector<ScanFunctions> scans;
+	std::vector<int64_t> kept;	// elements of each block kept by filtered stores
+	std::vector<int64_t> keptOffset;
+
+	TraceInterpreter(Trace* trace, Thread& thread)
+		: trace(trace)
+		, nodes(trace->nodes)
+		, threads(thread.state.threads.size())
+		, blocks((trace->Size+TRACE_BLOCK-1)/TRACE_BLOCK)
+		, skipped(nodes.size(), false)
+		, source(nodes.size())
+		, slot(nodes.size(), -1)
+		, slots(0)
+		, constant(nodes.size(), -1)
+		, folds(nodes.size())
+		, stride(nodes.size(), 0)
+		, partials(threads)
+		, chunk(0)
+		, scans(nodes.size())
+		, keptOffset(nodes.size(), -1) {
+		if(thread.state.epeeDeterministic) {
+			int64_t width = 0;
+			for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+				if(nodes[ref].group == IRNode::FOLD)
+					width += nodes[ref].shape.levels*Moments::Width + 16;
+			}
+			chunk = DeterministicChunk(trace->Size, width);
+			partials = std::max((trace->Size+chunk-1)/chunk, (int64_t)1);
+		}
+	}
+
+	// The nodes a node reads. mean and cm2 are computed from the inputs of the
+	// mean nodes directly rather than from the JIT's running values.
+	int Inputs(IRNode const& node, IRef* uses) {
+		int n = 0;
+		if(node.op == IROpCode::mean) {
+			uses[n++] = node.unary.a;
+		} else if(node.op == IROpCode::cm2) {
+			uses[n++] = nodes[node.binary.a].unary.a;
+			uses[n++] = nodes[node.binary.b].unary.a;
+		} else if(node.group != IRNode::SCALAR) {
+			switch(node.arity) {
+				case IRNode::TRINARY:
+					uses[n++] = node.trinary.c;
+				case IRNode::BINARY:
+					uses[n++] = node.binary.b;
+				case IRNode::UNARY:
+					uses[n++] = node.unary.a;
+				case IRNode::NULLARY:
+					break;
+			}
+		}
+		if(node.group != IRNode::SCALAR) {
+			if(node.shape.filter >= 0)
+				uses[n++] = node.shape.filter;
+			if(node.shape.split >= 0)
+				uses[n++] = node.shape.split;
+		}
+		return n;
+	}
+
+	void Compile() {
+		// share values where a node doesn't change them, and find the last use of each value
+		std::vector<IRef> last(nodes.size(), -1);
+		int64_t constantCount = 0;
+		for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+			IRNode const& node = nodes[ref];
+			source[ref] = ref;
+			IRef uses[5];
+			int n = Inputs(node, uses);
+
+			if(node.group == IRNode::MAP || node.group == IRNode::FILTER) {
+				for(int i = 0; i < n; i++)
+					if(nodes[uses[i]].group == IRNode::FOLD || skipped[uses[i]])
+						skipped[ref] = true;
+				if(skipped[ref]) {
+					if(node.liveOut) _error("NYI: output of a running fold");
+					continue;
+				}
+			}
+
+			if(	node.op == IROpCode::pos ||
+				node.op == IROpCode::split ||
+				(node.op == IROpCode::filter && node.shape.filter < 0))
+				source[ref] = source[node.unary.a];
+			else if(node.op == IROpCode::constant)
+				constant[ref] = constantCount++;
+
+			for(int i = 0; i < n; i++)
+				last[source[uses[i]]] = ref;
+			last[source[ref]] = std::max(last[source[ref]], ref);
+		}
+
+		std::vector< std::vector<IRef> > dead(nodes.size());
+		for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+			if(last[ref] >= 0)
+				dead[last[ref]].push_back(ref);
+		}
+
+		// assign scratch blocks, reusing them once their values are dead
+		std::vector<int64_t> available;
+		for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+			IRNode & node = nodes[ref];
+			bool computed = source[ref] == ref && !skipped[ref] &&
+				(node.group == IRNode::MAP || node.group == IRNode::FILTER ||
+				 (node.group == IRNode::GENERATOR && node.op != IROpCode::load && node.op != IROpCode::constant));
+			if(computed) {
+				if(available.size() > 0) {
+					slot[ref] = available.back();
+					available.pop_back();
+				} else {
+					slot[ref] = slots++;
+				}
+			}
+			for(size_t i = 0; i < dead[ref].size(); i++) {
+				if(slot[dead[ref][i]] >= 0)
+					available.push_back(slot[dead[ref][i]]);
+			}
+
+			// temporary space and outputs
+			if(node.group == IRNode::FOLD) {
+				folds[ref] = FoldFor(node);
+				stride[ref] = node.shape.levels*folds[ref].width + 16;
+				folds[ref].init(node.in, stride[ref]*partials);
+			}
+			else if(node.group == IRNode::SCAN) {
+				scans[ref] = ScanFor(node);
+				node.in = Allocate(node.type, std::max(blocks, (int64_t)2));	// at least 2, so it isn't packed
+				node.out = Allocate(node.type, node.outShape.length);
+			}
+			else if(node.liveOut && (node.group == IRNode::MAP || node.group == IRNode::GENERATOR)) {
+				if(node.shape.levels != 1)
+					_error("Group by without aggregate not yet supported");
+				node.out = Allocate(node.type, node.outShape.length);
+				if(node.shape.filter >= 0) {
+					keptOffset[ref] = kept.size();
+					kept.resize(kept.size()+blocks);
+				}
+			}
+		}
+
+		scratch.resize(std::max(slots*threads*TRACE_BLOCK, (int64_t)1));
+		constants.resize(std::max(constantCount*TRACE_BLOCK, (int64_t)1));
+		for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+			IRNode const& node = nodes[ref];
+			if(constant[ref] >= 0) {
+				double* c = &constants[constant[ref]*TRACE_BLOCK];
+				if(node.isDouble()) std::fill(c, c+TRACE_BLOCK, node.constant.d);
+				else if(node.isInteger()) std::fill((int64_t*)c, (int64_t*)c+TRACE_BLOCK, node.constant.i);
+				else if(node.isLogical()) std::fill((char*)c, (char*)c+TRACE_BLOCK, node.constant.l);
+				else _error("unexpected type");
+			}
+		}
+	}
+
+	void Generate(Thread& thread, IRNode const& node, std::vector<void const*>& values, void* r, int64_t start, int64_t n) {
+		switch(node.op) {
+			case IROpCode::load:
+				r = (char*)node.in.raw() + (start+node.constant.i)*Width(node.type);
+				break;
+			case IROpCode::seq:
+				if(node.isDouble()) {
+					for(int64_t i = 0; i < n; i++) ((double*)r)[i] = node.sequence.da + (start+i)*node.sequence.db;
+				} else {
+					for(int64_t i = 0; i < n; i++) ((int64_t*)r)[i] = node.sequence.ia + (start+i)*node.sequence.ib;
+				}
+				break;
+			case IROpCode::index:
+				for(int64_t i = 0; i < n; i++) ((int64_t*)r)[i] = ((start+i)/node.sequence.ib) % node.sequence.ia;
+				break;
+			case IROpCode::random:
+				// blocks start on even elements, so they start on a pair
+				for(int64_t i = 0; i < n; i += 2) {
+					__m128d v = Random::uniform(node.sequence.ia, node.sequence.ib, (start+i)/2);
+					if(i+1 < n) _mm_storeu_pd((double*)r+i, v);
+					else _mm_store_sd((double*)r+i, v);
+				}
+				break;
+			case IROpCode::gather: {
+				int64_t const* index = (int64_t const*)values[node.unary.a];
+				if(node.isDouble()) Gather((Double const&)node.in, index, r, n);
+				else if(node.isInteger()) Gather((Integer const&)node.in, index, r, n);
+				else if(node.isLogical()) Gather((Logical const&)node.in, index, r, n);
+				else _error("Unsupported type");
+			} break;
+			default:
+				_error("Bad generator in block interpreter");
+		}
+		values[&node-&nodes[0]] = r;
+	}
+
+	void Map(Thread& thread, IRNode const& node, std::vector<void const*>& values, void* r, int64_t n) {
+		IRef ref = &node-&nodes[0];
+		Type::Enum type = node.type;
+		switch(node.op) {
+			case IROpCode::addc:
+				if(node.isDouble()) BinaryConstant< addVOp<Double, Double> >(thread, values[node.unary.a], node.constant.d, r, n);
+				else BinaryConstant< addVOp<Integer, Integer> >(thread, values[node.unary.a], node.constant.i, r, n);
+				break;
+			case IROpCode::mulc:
+				if(node.isDouble()) BinaryConstant< mulVOp<Double, Double> >(thread, values[node.unary.a], node.constant.d, r, n);
+				else BinaryConstant< mulVOp<Integer, Integer> >(thread, values[node.unary.a], node.constant.i, r, n);
+				break;
+			case IROpCode::cast: {
+				Type::Enum ta = nodes[node.unary.a].type;
+				void const* a = values[node.unary.a];
+				#define CAST(From, To) if(ta == Type::From && type == Type::To) Unary< CastOp<From, To> >(thread, type, a, r, n); else
+				CAST(Double, Double) CAST(Double, Integer) CAST(Double, Logical)
+				CAST(Integer, Double) CAST(Integer, Integer) CAST(Integer, Logical)
+				CAST(Logical, Double) CAST(Logical, Integer) CAST(Logical, Logical)
+				_error("Unimplemented cast");
+				#undef CAST
+			} break;
+			case IROpCode::ifelse: {
+				char const* c = (char const*)values[node.trinary.c];
+				void const* a = values[node.trinary.a];
+				void const* b = values[node.trinary.b];
+				if(node.isDouble()) Select<Double>(c, a, b, r, n);
+				else if(node.isInteger()) Select<Integer>(c, a, b, r, n);
+				else if(node.isLogical()) Select<Logical>(c, a, b, r, n);
+				else _error("Unsupported type");
+			} break;
+			#define UNARY_CASE(Name, String, Group, Func) \
+			case IROpCode::Name: \
+				UnaryDispatch<Name##VOp>(thread, type, nodes[node.unary.a].type, values[node.unary.a], r, n); \
+				break;
+			#define BINARY_CASE(Name, String, Group, Func) \
+			case IROpCode::Name: \
+				BinaryDispatch<Name##VOp>(thread, type, nodes[node.binary.a].type, nodes[node.binary.b].type, \
+					values[node.binary.a], values[node.binary.b], r, n); \
+				break;
+			ARITH_UNARY_BYTECODES(UNARY_CASE)
+			LOGICAL_UNARY_BYTECODES(UNARY_CASE)
+			ORDINAL_UNARY_BYTECODES(UNARY_CASE)
+			BINARY_BYTECODES(BINARY_CASE)
+			#undef UNARY_CASE
+			#undef BINARY_CASE
+			default:
+				_error("unimplemented op");
+		}
+		values[ref] = r;
+	}
+
+	void Store(IRNode& node, void const* src, char const* f, int64_t start, int64_t n) {
+		int64_t width = Width(node.type);
+		char* dst = (char*)node.out.raw() + start*width;
+		if(f == 0) {
+			memcpy(dst, src, n*width);
+		} else {
+			// pack this block's kept elements at the front of its slice of the output
+			int64_t k = 0;
+			if(width == 8) {
+				for(int64_t i = 0; i < n; i++) {
+					((int64_t*)dst)[k] = ((int64_t const*)src)[i];
+					k += Logical::isTrue(f[i]) ? 1 : 0;
+				}
+			} else {
+				for(int64_t i = 0; i < n; i++) {
+					dst[k] = ((char const*)src)[i];
+					k += Logical::isTrue(f[i]) ? 1 : 0;
+				}
+			}
+			kept[keptOffset[&node-&nodes[0]] + start/TRACE_BLOCK] = k;
+		}
+	}
+
+	void Block(Thread& thread, std::vector<void const*>& values, int64_t start, int64_t n) {
+		char* blocks = (char*)&scratch[thread.index*slots*TRACE_BLOCK];
+		for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+			IRNode & node = nodes[ref];
+			if(skipped[ref])
+				continue;
+			void* r = slot[ref] >= 0 ? blocks + slot[ref]*TRACE_BLOCK*sizeof(double) : 0;
+			char const* f = node.shape.filter >= 0 ? (char const*)values[node.shape.filter] : 0;
+			int64_t const* s = node.shape.split >= 0 ? (int64_t const*)values[node.shape.split] : 0;
+
+			switch(node.group) {
+				case IRNode::GENERATOR:
+					if(node.op == IROpCode::constant)
+						values[ref] = &constants[constant[ref]*TRACE_BLOCK];
+					else
+						Generate(thread, node, values, r, start, n);
+					break;
+				case IRNode::MAP:
+					if(node.op == IROpCode::pos)
+						values[ref] = values[node.unary.a];
+					else
+						Map(thread, node, values, r, n);
+					break;
+				case IRNode::FILTER:
+					if(node.shape.filter >= 0) {
+						Binary< landVOp<Logical, Logical> >(thread, Type::Logical, values[node.unary.a], f, r, n);
+						values[ref] = r;
+					} else {
+						values[ref] = values[node.unary.a];
+					}
+					break;
+				case IRNode::SPLIT:
+					values[ref] = values[node.unary.a];
+					break;
+				case IRNode::FOLD: {
+					int64_t p = chunk > 0 ? start/chunk : thread.index;
+					void* acc = (char*)node.in.raw() + p*stride[ref]*Width(node.in.type());
+					if(node.op == IROpCode::cm2)
+						folds[ref].fold(thread, acc, values[nodes[node.binary.a].unary.a], values[nodes[node.binary.b].unary.a], f, s, node.shape.levels, n);
+					else if(node.op == IROpCode::length)
+						folds[ref].fold(thread, acc, 0, 0, f, s, node.shape.levels, n);
+					else
+						folds[ref].fold(thread, acc, values[node.unary.a], 0, f, s, node.shape.levels, n);
+				} break;
+				case IRNode::SCAN:
+					scans[ref].scan(thread, values[node.unary.a],
+						(char*)node.out.raw() + start*8, (char*)node.in.raw() + (start/TRACE_BLOCK)*8, n);
+					break;
+				case IRNode::NOP:
+				case IRNode::SCALAR:
+					break;
+			}
+
+			if(node.liveOut && (node.group == IRNode::MAP || node.group == IRNode::GENERATOR))
+				Store(node, values[ref], f, start, n);
+		}
+	}
+
+	static void body(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+		TraceInterpreter& t = *(TraceInterpreter*)args;
+		std::vector<void const*> values(t.nodes.size(), 0);
+		for(uint64_t i = start; i < end; i += TRACE_BLOCK)
+			t.Block(thread, values, i, std::min(end-i, (uint64_t)TRACE_BLOCK));
+	}
+
+	struct Fixup {
+		IRNode const* node;
+		ScanFunctions scan;
+	};
+
+	// add the carry into each block of a scan
+	static void fixup(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+		Fixup const& f = *(Fixup const*)args;
+		for(uint64_t i = start; i < end; i += TRACE_BLOCK)
+			f.scan.fixup(thread, (char const*)f.node->in.raw() + (i/TRACE_BLOCK)*8,
+				(char*)f.node->out.raw() + i*8, std::min(end-i, (uint64_t)TRACE_BLOCK));
+	}
+
+	struct Compaction {
+		char const* src;
+		int64_t width;
+		int64_t const* offsets;
+		int64_t const* counts;
+		char* dst;
+	};
+
+	static void compact(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+		Compaction const& c = *(Compaction const*)args;
+		for(uint64_t b = start; b < end; b++)
+			memcpy(c.dst + c.offsets[b]*c.width, c.src + b*TRACE_BLOCK*c.width, c.counts[b]*c.width);
+	}
+
+	void Execute(Thread& thread) {
+		if(chunk > 0)
+			thread.doall(NULL, body, this, 0, trace->Size, chunk, chunk);
+		else
+			thread.doall(NULL, body, this, 0, trace->Size, TRACE_BLOCK, TRACE_BLOCK);
+	}
+
+	void Merge(Thread& thread) {
+		for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+			IRNode & node = nodes[ref];
+
+			if(node.group == IRNode::FOLD) {
+				char* acc = (char*)node.in.raw();
+				int64_t step = stride[ref]*Width(node.in.type());
+				// in thread order, or pairwise across chunks in a fixed tree
+				if(chunk == 0) {
+					for(int64_t t = 1; t < partials; t++)
+						folds[ref].merge(thread, acc, acc + t*step, node.shape.levels);
+				} else {
+					for(int64_t s = 1; s < partials; s *= 2)
+						for(int64_t j = 0; j+s < partials; j += 2*s)
+							folds[ref].merge(thread, acc + j*step, acc + (j+s)*step, node.shape.levels);
+				}
+				folds[ref].result(acc, node.shape.levels, node.out);
+			}
+			else if(node.group == IRNode::SCAN) {
+				if(blocks > 1) {
+					scans[ref].carry(thread, node.in);
+					Fixup f = { &node, scans[ref] };
+					thread.doall(NULL, fixup, &f, TRACE_BLOCK, trace->Size, TRACE_BLOCK, TRACE_BLOCK);
+				}
+			}
+			else if(keptOffset[ref] >= 0) {
+				int64_t* counts = &kept[keptOffset[ref]];
+				std::vector<int64_t> offsets(blocks);
+				int64_t length = 0;
+				for(int64_t b = 0; b < blocks; b++) {
+					offsets[b] = length;
+					length += counts[b];
+				}
+				if(length == 1) {
+					int64_t b = 0;
+					while(counts[b] == 0) b++;
+					node.out = Single(node.type, node.out.raw(), b*TRACE_BLOCK);
+				} else {
+					Vector result = Allocate(node.type, length);
+					Compaction c = { (char const*)node.out.raw(), Width(node.type), &offsets[0], counts, (char*)result.raw() };
+					thread.doall(NULL, compact, &c, 0, blocks, 1, 16);
+					node.out = result;
+				}
+			}
+		}
+
+		// copy to output vector
+		for(IRef ref = 0; ref < (int64_t)nodes.size(); ref++) {
+			IRNode & node = nodes[ref];
+
+			if(node.op == IROpCode::sload) {
+				node.out = node.in;
+			} else if(node.op == IROpCode::sstore) {
+				Integer index = Integer::c(node.binary.data);
+				Subset2Assign(thread,
+					nodes[node.binary.a].out,
+					true,
+					index,
+					nodes[node.binary.b].out,
+					node.out);
+			}
+		}
+	}
+};
+
+void Trace::Interpret(Thread & thread) {
+	timespec begin = get_time();
+	TraceInterpreter interpreter(this, thread);
+	interpreter.Compile();
+	setup += time_elapsed(begin);
+	interpreter.Execute(thread);
+	interpreter.Merge(thread);
+}
@@ -0,0 +1,186 @@
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../interpreter.h"
+
+// Tells perf what the code in the trace code buffers is. Either as a
+// /tmp/perf-<pid>.map, which perf reads directly, or as a jitdump that
+// `perf inject --jit` merges into a recording made with `perf record -k 1`.
+// The jitdump also maps each node's code to its line of the trace's IR,
+// which is appended to /tmp/epee-<pid>.ir, so `perf annotate` shows the IR.
+// Code buffers are reused, so the map only names the latest trace compiled
+// into each of them. The jitdump's timestamps keep them apart.
+
+static FILE* perfMap = 0;
+static FILE* jitDump = 0;
+static FILE* irSource = 0;
+static int64_t irLines = 0;
+static uint64_t codeIndex = 0;
+static Lock announcing;	// traces are compiled on every thread
+
+enum {
+	JIT_CODE_LOAD = 0,
+	JIT_CODE_DEBUG_INFO = 2
+};
+
+struct JitHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+};
+
+struct JitRecord {
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+};
+
+struct JitCodeLoad {
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+};
+
+struct JitDebugInfo {
+	uint64_t code_addr;
+	uint64_t nr_entry;
+};
+
+struct JitDebugEntry {
+	uint64_t addr;
+	int32_t lineno;
+	int32_t discrim;
+};
+
+// perf record -k 1 stamps samples with the monotonic clock
+static uint64_t Timestamp() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static FILE* Open(char const* format) {
+	char name[64];
+	snprintf(name, sizeof(name), format, (int)getpid());
+	FILE* f = fopen(name, "w+");
+	if(f == 0)
+		_error(std::string("can't open ") + name);
+	return f;
+}
+
+static void OpenJitDump() {
+	jitDump = Open("/tmp/jit-%d.dump");
+	irSource = Open("/tmp/epee-%d.ir");
+
+	JitHeader h;
+	h.magic = 0x4A695444;
+	h.version = 1;
+	h.total_size = sizeof(JitHeader);
+	h.elf_mach = 62;	// EM_X86_64
+	h.pad1 = 0;
+	h.pid = getpid();
+	h.timestamp = Timestamp();
+	h.flags = 0;
+	fwrite(&h, sizeof(h), 1, jitDump);
+	fflush(jitDump);
+
+	// perf finds the dump through this mapping in the recording
+	long page = sysconf(_SC_PAGESIZE);
+	if(mmap(0, page, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(jitDump), 0) == MAP_FAILED)
+		_error("can't map the jitdump for perf");
+}
+
+// e.g. "epee[3000] seq,mul,sum @ function(x) {:12"
+static std::string Name(Trace const& trace) {
+	std::ostringstream out;
+	out << "epee[" << trace.Size << "] ";
+	int ops = 0;
+	for(size_t i = 0; i < trace.nodes.size() && ops < 6; i++) {
+		IRNode const& node = trace.nodes[i];
+		if(node.group == IRNode::NOP || node.op == IROpCode::constant)
+			continue;
+		out << (ops++ > 0 ? "," : "") << IROpCode::toString(node.op);
+	}
+	if(trace.source != 0)
+		out << " @ " << SiteName(trace.source, trace.pc);
+	return out.str();
+}
+
+void Trace::Announce(Thread & thread, void const* code, int64_t size, std::vector<int> const& offsets) {
+	std::string name = Name(*this);
+	std::string ir = thread.state.perf == State::PerfMap ? std::string() : toString(thread);
+
+	announcing.acquire();
+	try {
+		if(thread.state.perf == State::PerfMap && perfMap == 0)
+			perfMap = Open("/tmp/perf-%d.map");
+		else if(thread.state.perf != State::PerfMap && jitDump == 0)
+			OpenJitDump();
+	} catch(...) {
+		announcing.release();
+		throw;
+	}
+
+	if(thread.state.perf == State::PerfMap) {
+		fprintf(perfMap, "%llx %llx %s\n", (unsigned long long)code, (unsigned long long)size, name.c_str());
+		fflush(perfMap);
+		announcing.release();
+		return;
+	}
+
+	// the IR is the source, node i is on line first+i
+	fputs(ir.c_str(), irSource);
+	fflush(irSource);
+	int64_t first = irLines + 1;
+	irLines += nodes.size();
+
+	char file[64];
+	snprintf(file, sizeof(file), "/tmp/epee-%d.ir", (int)getpid());
+	uint64_t timestamp = Timestamp();
+
+	JitRecord r;
+	r.id = JIT_CODE_DEBUG_INFO;
+	r.timestamp = timestamp;
+	r.total_size = sizeof(JitRecord) + sizeof(JitDebugInfo) + offsets.size() * (sizeof(JitDebugEntry) + strlen(file) + 1);
+	JitDebugInfo d;
+	d.code_addr = (uint64_t)code;
+	d.nr_entry = offsets.size();
+	fwrite(&r, sizeof(r), 1, jitDump);
+	fwrite(&d, sizeof(d), 1, jitDump);
+	for(size_t i = 0; i < offsets.size(); i++) {
+		JitDebugEntry e;
+		e.addr = (uint64_t)code + offsets[i];
+		e.lineno = first + i;
+		e.discrim = 0;
+		fwrite(&e, sizeof(e), 1, jitDump);
+		fwrite(file, strlen(file) + 1, 1, jitDump);
+	}
+
+	r.id = JIT_CODE_LOAD;
+	r.total_size = sizeof(JitRecord) + sizeof(JitCodeLoad) + name.size() + 1 + size;
+	JitCodeLoad l;
+	l.pid = getpid();
+	l.tid = syscall(SYS_gettid);
+	l.vma = (uint64_t)code;
+	l.code_addr = (uint64_t)code;
+	l.code_size = size;
+	l.code_index = codeIndex++;
+	fwrite(&r, sizeof(r), 1, jitDump);
+	fwrite(&l, sizeof(l), 1, jitDump);
+	fwrite(name.c_str(), name.size() + 1, 1, jitDump);
+	fwrite(code, size, 1, jitDump);
+	fflush(jitDump);
+	announcing.release();
+}
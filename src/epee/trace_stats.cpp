@@ -0,0 +1,58 @@
+
+#include <iomanip>
+
+#include "../interpreter.h"
+
+// Telemetry on the traces each recording site started, so we can tell which
+// scripts epee helps. trace.stats() returns it, --trace-stats=FILE writes it
+// out as JSON when riposte exits.
+
+std::string SiteName(String source, int64_t pc) {
+	if(source == 0)
+		return "<unknown>";
+	std::string s(source);
+	s = s.substr(0, std::min(s.find('\n'), (size_t)40));
+	std::ostringstream out;
+	out << s << ":" << pc;
+	return out.str();
+}
+
+static std::string Quote(std::string const& s) {
+	std::ostringstream out;
+	out << '"';
+	for(size_t i = 0; i < s.size(); i++) {
+		unsigned char c = s[i];
+		if(c == '"' || c == '\\')
+			out << '\\' << c;
+		else if(c < 0x20)
+			out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+		else
+			out << c;
+	}
+	out << '"';
+	return out.str();
+}
+
+void Traces::WriteStats(std::ostream& out) const {
+	out << "[";
+	bool first = true;
+	for(std::map<Instruction const*, TraceSite>::const_iterator i = sites.begin(); i != sites.end(); ++i) {
+		TraceSite const& s = i->second;
+		if(s.traces == 0)
+			continue;
+		out << (first ? "\n" : ",\n");
+		first = false;
+		out << "  {\"site\": " << Quote(SiteName(s.source, s.pc))
+			<< ", \"traces\": " << s.traces
+			<< ", \"nodes_recorded\": " << s.recorded
+			<< ", \"nodes_optimized\": " << s.optimized
+			<< ", \"compile_ns\": " << (int64_t)(s.compile * 1e9)
+			<< ", \"execute_ns\": " << (int64_t)(s.execute * 1e9)
+			<< ", \"elements\": " << s.elements
+			<< ", \"elements_per_sec\": " << (s.execute > 0 ? s.elements / s.execute : 0)
+			<< ", \"spills\": " << s.spills
+			<< ", \"bytes_materialized\": " << s.bytes
+			<< ", \"launched\": " << s.launched << "}";
+	}
+	out << "\n]\n";
+}
@@ -0,0 +1,107 @@
+
+#include <math.h>
+#include <stdio.h>
+
+#include "../interpreter.h"
+
+// Sizes the chunks a trace is dealt out in from what its elements cost. A STREAM
+// triad run before the first trace is compiled measures how fast one thread, and all of them together,
+// stream memory, and two short loops how fast a thread does arithmetic and calls
+// exp. A trace that moves more bytes than it computes on stops getting faster once
+// its threads saturate memory, so it's split into one big chunk for each thread it
+// needs. Compute-bound traces get every thread and smaller chunks, so stealing can
+// even them out.
+
+static Machine machine = { 0, 0, 0, 0 };
+static bool calibrated = false;
+static Lock calibrating;
+
+static const int64_t STREAM = 1 << 21;	// doubles in each of the triad's vectors, 16MB, past most caches
+static const int64_t FINE = 8;	// chunks for each thread in compute-bound traces
+static const uint64_t MIN_PPT = 256;
+static const uint64_t DEFAULT_PPT = 1024;
+
+struct Triad {
+	double* a;
+	double const* b;
+	double const* c;
+};
+
+static void triad(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+	Triad const& t = *(Triad const*)args;
+	for(uint64_t i = start; i < end; i++)
+		t.a[i] = t.b[i] + 3.0 * t.c[i];
+}
+
+static volatile double sink;
+
+void CalibrateMachine(Thread& thread) {
+	int64_t n = thread.state.threads.size();
+	if(n < 2)
+		return;
+	calibrating.acquire();
+	if(calibrated) {
+		calibrating.release();
+		return;
+	}
+	calibrated = true;
+
+	std::vector<double> a(STREAM, 0), b(STREAM, 1), c(STREAM, 2);
+	Triad t = { &a[0], &b[0], &c[0] };
+	double bytes = 3.0 * sizeof(double) * STREAM;
+
+	// the vectors' pages were faulted in when they were filled
+	double s = monotonic_time();
+	triad(&t, 0, 0, STREAM, thread);
+	machine.bandwidth = bytes / (monotonic_time() - s);
+
+	s = monotonic_time();
+	thread.doall(NULL, triad, &t, 0, STREAM, 64, (STREAM+n-1)/n);
+	machine.saturated = std::max(bytes / (monotonic_time() - s), machine.bandwidth);
+
+	double x[256];
+	for(int64_t i = 0; i < 256; i++)
+		x[i] = i;
+	s = monotonic_time();
+	for(int64_t r = 0; r < 4096; r++)
+		for(int64_t i = 0; i < 256; i++)
+			x[i] = x[i] * 0.999 + 0.5;
+	machine.ops = 2.0 * 256 * 4096 / (monotonic_time() - s);
+
+	double e = 0;
+	s = monotonic_time();
+	for(int64_t i = 0; i < 65536; i++)
+		e += exp(x[i & 255] * 1e-3 + i * 1e-9);
+	machine.calls = 65536 / (monotonic_time() - s);
+	sink = e + x[0];
+
+	if(thread.state.verbose)
+		printf("calibrated: one thread streams %.1f GB/s and all %d %.1f GB/s, %.0f M ops/s and %.0f M calls/s a thread\n",
+			machine.bandwidth / 1e9, (int)n, machine.saturated / 1e9, machine.ops / 1e6, machine.calls / 1e6);
+	calibrating.release();
+}
+
+TraceSchedule Schedule(Thread const& thread, int64_t size, double bytes, double ops, double calls) {
+	int64_t n = thread.state.threads.size();
+	TraceSchedule r = { n, DEFAULT_PPT };
+	if(n < 2 || machine.bandwidth <= 0)
+		return r;
+
+	// seconds an element takes on k threads, and the fewest that come within 10% of all of them
+	double compute = ops / machine.ops + calls / machine.calls;
+	double all = std::max(compute / n, bytes / machine.saturated);
+	for(int64_t k = 1; k <= n; k++) {
+		double time = std::max(compute / k, bytes / std::min(k * machine.bandwidth, machine.saturated));
+		if(time <= all * 1.1) {
+			r.threads = k;
+			break;
+		}
+	}
+
+	// only as many chunks as threads, so no more than that run it
+	if(r.threads < n)
+		r.ppt = std::max(DEFAULT_PPT, (uint64_t)((size + r.threads - 1) / r.threads));
+	else
+		r.ppt = std::max(MIN_PPT, (uint64_t)((size + n*FINE - 1) / (n*FINE)));
+	return r;
+}
@@ -132,9 +132,12 @@ void Prototype::visit() const {
 
 void Heap::mark(State& state) {
 	// traverse root set
-	// mark the region that I'm currently allocating into
-	((GCObject*)((uint64_t)bump & ~(PAGE_SIZE-1)))->flags |= 1;
-	gcObject(bump)->flags |= 1;
+	// mark the regions threads are currently allocating into
+	for(uint64_t i = 0; i < bumps.size(); i++) {
+		char* bump = bumps[i]->bump;
+		((GCObject*)((uint64_t)bump & ~(PAGE_SIZE-1)))->flags |= 1;
+		gcObject(bump)->flags |= 1;
+	}
 	
 	// iterate over path, then stack, then trace locations, then registers
 	//printf("--path--\n");
@@ -158,11 +161,39 @@ void Heap::mark(State& state) {
 		VISIT(thread->frame.prototype);
 
 		//printf("--trace--\n");
-		// traces only hold weak references...
+		// traces only hold weak references to their outputs,
+		// but the vectors they load must survive until they execute...
+#ifdef EPEE
+		std::map<int64_t, Trace*> const& recording = thread->traces.Recording();
+		for(std::map<int64_t, Trace*>::const_iterator i = recording.begin(); i != recording.end(); ++i) {
+			std::vector<IRNode> const& nodes = i->second->nodes;
+			for(uint64_t j = 0; j < nodes.size(); j++) {
+				if(nodes[j].op == IROpCode::load || nodes[j].op == IROpCode::gather || nodes[j].op == IROpCode::sload)
+					traverse(nodes[j].in);
+			}
+			// the environments its outputs may be written back to, too
+			for(std::set<Environment*>::const_iterator k = i->second->liveEnvironments.begin(); k != i->second->liveEnvironments.end(); ++k) {
+				VISIT(*k);
+			}
+		}
+		// ...and a launched trace is still writing into its outputs
+		Trace const* running = thread->traces.Running();
+		if(running != 0) {
+			for(uint64_t i = 0; i < running->roots.size(); i++) {
+				traverse(running->roots[i]);
+			}
+			for(std::set<Environment*>::const_iterator i = running->liveEnvironments.begin(); i != running->liveEnvironments.end(); ++i) {
+				VISIT(*i);
+			}
+		}
+#endif
 
 		//printf("--registers--\n");
-		for(Value const* r = thread->registers; r < thread->frame.registers+thread->frame.prototype->registers; ++r) {
-			traverse(*r);
+		// worker threads don't have a frame until they run some code
+		if(thread->frame.prototype != 0) {
+			for(Value const* r = thread->registers; r < thread->frame.registers+thread->frame.prototype->registers; ++r) {
+				traverse(*r);
+			}
 		}
 
 		for(uint64_t i = 0; i < thread->gcStack.size(); i++) {
@@ -211,7 +242,13 @@ void Heap::makeRegions(uint64_t regions) {
 	}
 }
 
-void Heap::popRegion() {
+Heap::Bump* Heap::popRegion() {
+	lock.acquire();
+	if(local == 0) {
+		local = new Bump();
+		bumps.push_back(local);
+	}
+
 	//printf("Making new region: %d\n", freeRegions.size());
 	if(freeRegions.empty())
 		makeRegions(256);
@@ -224,9 +261,12 @@ void Heap::popRegion() {
 	total += g->size;
 	root = r;
 
-	bump = (char*)(g->data);
-	limit = ((char*)g) + regionSize;
+	local->bump = (char*)(g->data);
+	local->limit = ((char*)g) + regionSize;
+	lock.release();
+	return local;
 }
 
+__thread Heap::Bump* Heap::local = 0;
 Heap Heap::Global;
 
@@ -3,7 +3,9 @@
 #define RIPOSTE_GC_H
 
 #include <deque>
+#include <vector>
 #include "common.h"
+#include "thread.h"
 #include <assert.h>
 
 #define PAGE_SIZE 4096
@@ -51,42 +53,55 @@ private:
 	void* root;
 	uint64_t heapSize;
 	uint64_t total;
+	int64_t paused;
 
 	void mark(State& state);
 	void sweep();
 	
+	// each thread bumps through a region of its own,
+	// the lock guards everything else
+	struct Bump {
+		char* bump, *limit;
+	};
+	static __thread Bump* local;
+	std::vector<Bump*> bumps;
+	Lock lock;
+
 	void makeRegions(uint64_t regions);
-	void popRegion();	
+	Bump* popRegion();	
 
 	std::deque<void*> freeRegions;
-	char* bump, *limit;
 
 	GCObject* gcObject(void* v) const {
 		return (GCObject*)(((uint64_t)v+(regionSize-1)) & (~(regionSize-1)));
 	}
 
 public:
-	Heap() : root(0), heapSize(1<<20), total(0) {
-		popRegion();
-	}
+	Heap() : root(0), heapSize(1<<20), total(0), paused(0) {}
 
 	HeapObject* smallalloc(uint64_t bytes);
 	HeapObject* alloc(uint64_t bytes);
 	void collect(State& state);
 
+	// While other threads are running R code they aren't at a safe point,
+	// so the collector waits until they're done.
+	void pause() { fetch_and_add(&paused, 1); }
+	void resume() { fetch_and_add(&paused, -1); }
+
 	static Heap Global;
 };
 
 inline HeapObject* Heap::smallalloc(uint64_t bytes) {
 	bytes = (bytes + 63) & (~63);
-	if(bump+bytes >= limit)
-		popRegion();
+	Bump* b = local;
+	if(b == 0 || b->bump+bytes >= b->limit)
+		b = popRegion();
 	
-	//printf("Region: allocating %d at %llx\n", bytes, (uint64_t)bump);
-	HeapObject* o = (HeapObject*)bump;
+	//printf("Region: allocating %d at %llx\n", bytes, (uint64_t)b->bump);
+	HeapObject* o = (HeapObject*)b->bump;
 	assert(((uint64_t) o & 63) == 0);
 	//memset(o, 0xba, bytes);
-	bump += bytes;
+	b->bump += bytes;
 	return o;
 }
 
@@ -94,19 +109,21 @@ inline HeapObject* Heap::alloc(uint64_t bytes) {
 	bytes += sizeof(GCObject);
 	bytes = (bytes + 63) & (~63);
 	
-	total += bytes+regionSize;
 	void* head = (void*)malloc(bytes+regionSize);
 	//memset(head, 0xab, bytes+regionSize);
 	GCObject* g = gcObject(head);
 	assert(((uint64_t) g & 63) == 0);
+	lock.acquire();
+	total += bytes+regionSize;
 	g->init(bytes+regionSize, root);
 	root = head;
+	lock.release();
 
 	return (HeapObject*)(g->data);
 }
 
 inline void Heap::collect(State& state) {
-	if(total > heapSize) {
+	if(total > heapSize && fetch_and_add(&paused, 0) == 0) {
 		mark(state);
 		sweep();
 		if(total > heapSize*0.6 && heapSize < (1<<30))
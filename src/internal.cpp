@@ -4,6 +4,7 @@
 #include "parser.h"
 #include "library.h"
 #include "coerce.h"
+#include "call.h"
 
 #include <math.h>
 #include <fstream>
@@ -35,21 +36,24 @@ TYPES(CASE)
 	_error("Invalid type");
 }
 
-Double RandomVector(Thread& thread, int64_t const length) {
-	//Thread::RandomSeed& r = Thread::seed[thread.index];
+Double RandomVector(Thread& thread, int64_t const length, int64_t const stream) {
 	Double o(length);
-	for(int64_t i = 0; i < length; i++) {
-		/*r.v[0] = r.v[0] * r.m[0] + r.a[0];
-		r.v[0] = r.v[0] * r.m[0] + r.a[0];
-		r.v[0] = r.v[0] * r.m[0] + r.a[0];
-
-		o[i] = (double)r.v[0] / ((double)std::numeric_limits<uint64_t>::max() + 1);*/
-
-		o[i] = rand() / (double)RAND_MAX;
+	uint64_t seed = thread.state.random.seed;
+	for(int64_t i = 0; i < length; i += 2) {
+		double d[2];
+		_mm_storeu_pd(d, Random::uniform(seed, stream, i/2));
+		o[i] = d[0];
+		if(i+1 < length) o[i+1] = d[1];
 	}
 	return o;
 }
 
+void setseed(Thread& thread, Value const* args, Value& result) {
+	thread.state.random.seed = (uint64_t)As<Integer>(thread, args[0])[0];
+	thread.state.random.stream = 0;
+	result = Null::Singleton();
+}
+
 void cat(Thread& thread, Value const* args, Value& result) {
 	List const& a = Cast<List>(args[0]);
 	Character const& b = Cast<Character>(args[1]);
@@ -133,7 +137,7 @@ void readtable(Thread& thread, Value const* args, Value& result) {
 						((std::vector<double>*)lists[list_idx])->push_back(date);
 						list_idx++;
 					} else if(Strings::Character == format[i]) {
-						String s = thread.internStr(rest);
+						String s = thread.internStr(rest, sep_location - rest);
 						((std::vector<String>*)lists[list_idx])->push_back(s);
 						list_idx++;
 					}
@@ -327,45 +331,113 @@ void eval_fn(Thread& thread, Value const* args, Value& result) {
 			Cast<REnvironment>(args[1]).environment());
 }
 
-struct mapplyargs {
+// Calls func on the i-th elements of the vectors in `in`, recycled, across the threads.
+// Each thread gets its own copy of the call, so the argument slots it fills in aren't
+// shared, and its own stack frames. The first error any call hits is rethrown after.
+struct applyargs {
+	enum Reduction { ADD, MIN, MAX, CONCAT };
+
 	List const& in;
-	List& out;
-	Value const& func;
+	Value& out;
+	int64_t width;	// for vapply, the length of each result, or -1 for a list
+	Environment* environment;
+	std::vector<Prototype*> calls;
+	std::string error;
+	Lock lock;
+
+	// for .ParFor, how each result (or each element of a list result, if multiple) is
+	// reduced. Every chunk of ppt iterations reduces into its own slot, in order,
+	// concatenations keep every result, and both are merged at the end.
+	std::vector<Reduction> reductions;
+	bool multiple;
+	int64_t ppt;
+	std::vector<List> partials;
+
+	applyargs(Thread& thread, List const& in, Value const& func, Value& out, int64_t width) 
+		: in(in), out(out), width(width), environment(thread.frame.environment), multiple(false), ppt(1) {
+		List apply(1+in.length());
+		apply[0] = func;
+		for(int64_t i = 0; i < in.length(); i++)
+			apply[i+1] = Value::Nil();
+		for(uint64_t i = 0; i < thread.state.threads.size(); i++)
+			calls.push_back(Compiler::compileTopLevel(thread, CreateCall(apply)));
+	}
 };
 
-void* mapplyheader(void* args, uint64_t start, uint64_t end, Thread& thread) {
-	mapplyargs& l = *(mapplyargs*)args;
-	List apply(1+l.in.length());
-	apply[0] = l.func;
-	for(int64_t i = 0; i < l.in.length(); i++)
-		apply[i+1] = Value::Nil();
-	Prototype* p = Compiler::compileTopLevel(thread, CreateCall(apply));
-	return p;
-}
-
-void mapplybody(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
-	mapplyargs& l = *(mapplyargs*)args;
-	Prototype* p = (Prototype*) header;
-	for( size_t i=start; i!=end; ++i ) {
-		for(int64_t j=0; j < l.in.length(); j++) {
-			Value e;
-			Element2(l.in, j, e);
-			Value a;
-			if(e.isVector())
-				Element2(e, i % ((Vector const&)e).length(), a);
-			else
-				a = e;
-			p->calls[0].arguments[j].v = a;
+static void reduce(Thread& thread, applyargs::Reduction r, Value const& a, Value const& b, Value& c) {
+	if(a.isNil())
+		c = b;
+	else if(r == applyargs::ADD)
+		ArithBinary1Dispatch<addVOp>(thread, a, b, c);
+	else if(r == applyargs::MIN)
+		UnifyBinaryDispatch<pminVOp>(thread, a, b, c);
+	else
+		UnifyBinaryDispatch<pmaxVOp>(thread, a, b, c);
+}
+
+static void store(Thread& thread, applyargs& l, int64_t i, Value const& v) {
+	if(!l.reductions.empty()) {
+		if(l.multiple && (!v.isList() || ((List const&)v).length() != (int64_t)l.reductions.size()))
+			_error(std::string("the loop body must return a list of ") + intToStr(l.reductions.size()) + " values to reduce");
+		for(size_t k = 0; k < l.reductions.size(); k++) {
+			Value const& e = l.multiple ? ((List const&)v)[k] : v;
+			if(l.reductions[k] == applyargs::CONCAT)
+				l.partials[k][i] = e;
+			else {
+				Value& p = l.partials[k][i / l.ppt];
+				reduce(thread, l.reductions[k], p, e, p);
+			}
 		}
-		l.out[i] = thread.eval(p);
+		return;
+	}
+	if(l.width < 0) {
+		((List&)l.out)[i] = v;
+		return;
+	}
+	if(!v.isVector() || ((Vector const&)v).length() != l.width)
+		_error(std::string("values must be length ") + intToStr(l.width) + ", but FUN(X[[" + intToStr(i+1) + "]]) result is length " + intToStr(v.isVector() ? ((Vector const&)v).length() : 1));
+	// like R, logicals may go in integers and both may go in doubles, but no further
+	Type::Enum t = l.out.type();
+	if(v.type() != t && !(v.isLogical() && t == Type::Integer) && !((v.isLogical() || v.isInteger()) && t == Type::Double))
+		_error(std::string("values must be type '") + Type::toString(t) + "', but FUN(X[[" + intToStr(i+1) + "]]) result is type '" + Type::toString(v.type()) + "'");
+	switch(t) {
+		#define CASE(Name) case Type::Name: Insert(thread, As<Name>(thread, v), 0, l.out, i*l.width, l.width); break;
+		VECTOR_TYPES_NOT_NULL(CASE)
+		#undef CASE
+		default: _error(std::string("NYI: vapply to ") + Type::toString(t)); break;
 	}
-	//return 0;
 }
 
-void mapply(Thread& thread, Value const* args, Value& result) {
-	List const& x = (List const&)args[0];
-	Value const& func = args[1];
-	// figure out result length
+void applybody(void* args, void* header, uint64_t start, uint64_t end, Thread& thread) {
+	applyargs& l = *(applyargs*)args;
+	Prototype* p = l.calls[thread.index];
+	try {
+		for( size_t i=start; i!=end; ++i ) {
+			for(int64_t j=0; j < l.in.length(); j++) {
+				Value e;
+				Element2(l.in, j, e);
+				Value a;
+				if(e.isVector())
+					Element2(e, i % ((Vector const&)e).length(), a);
+				else
+					a = e;
+				p->calls[0].arguments[j].v = a;
+			}
+			// a future is only good on the thread whose traces it's in
+			Value v = thread.eval(p, l.environment);
+			thread.traces.Bind(thread, v);
+			store(thread, l, i, v);
+		}
+		thread.traces.Flush(thread);
+	} catch(RiposteException& e) {
+		l.lock.acquire();
+		if(l.error.empty())
+			l.error = e.what();
+		l.lock.release();
+	}
+}
+
+static int64_t applyLength(List const& x) {
 	int64_t len = 1;
 	for(int i = 0; i < x.length(); i++) {
 		Value e;
@@ -373,49 +445,169 @@ void mapply(Thread& thread, Value const* args, Value& result) {
 		if(e.isVector()) 
 			len = (((Vector const&)e).length() == 0 || len == 0) ? 0 : std::max(((Vector const&)e).length(), len);
 	}
+	return len;
+}
+
+static const int64_t APPLY_BATCH = 16;	// chunks for each thread between collections
+
+// The calls are made a batch at a time. Nothing can be collected while they run, so
+// between batches, with every thread back at a safe point, the garbage they made is.
+static void parallelApply(Thread& thread, applyargs& a, int64_t len) {
+	// the calls may read futures out of the environment, run them here first
+	thread.traces.Flush(thread);
+	size_t rooted = thread.gcStack.size();
+	thread.gcStack.push_back(a.out);
+	thread.gcStack.push_back(a.in);
+	for(size_t i = 0; i < a.calls.size(); i++) {
+		Value call;
+		Promise::Init(call, a.environment, a.calls[i], false);
+		thread.gcStack.push_back(call);
+	}
+	int64_t batch = a.ppt * APPLY_BATCH * (int64_t)thread.state.threads.size();
+	for(int64_t i = 0; i < len && a.error.empty(); i += batch) {
+		Heap::Global.pause();
+		// bulk, so the traces the calls run are helped with before more calls are started
+		thread.doall(0, applybody, &a, i, std::min(i+batch, len), a.ppt, a.ppt, Thread::Task::BULK); 
+		Heap::Global.resume();
+		Heap::Global.collect(thread.state);
+	}
+	thread.gcStack.resize(rooted);
+	if(!a.error.empty())
+		_error(a.error);
+}
+
+static void parallelApply(Thread& thread, List const& x, Value const& func, Value& r, int64_t len, int64_t width) {
+	applyargs a(thread, x, func, r, width);
+	parallelApply(thread, a, len);
+}
+
+void mapply(Thread& thread, Value const* args, Value& result) {
+	List const& x = (List const&)args[0];
+	Value const& func = args[1];
+	int64_t len = applyLength(x);
+	List r(len);
+	memset(r.v(), 0, len*sizeof(List::Element));
+	parallelApply(thread, x, func, r, len, -1);
+	result = r;
+}
+
+void lapply(Thread& thread, Value const* args, Value& result) {
+	List x(1);
+	x[0] = args[0];
+	int64_t len = applyLength(x);
 	List r(len);
 	memset(r.v(), 0, len*sizeof(List::Element));
-	thread.gcStack.push_back(r);
-
-	/*List apply(2);
-	apply[0] = func;
-
-	// TODO: should have a way to make a simple function call without compiling,
-	// or should have a fast case for compilation
-	Thread ithread(state);
-	for(int64_t i = 0; i < x.length; i++) {
-		apply[1] = x[i];
-		r[i] = eval(ithread, Compiler::compile(thread, CreateCall(apply)));
-	}*/
-
-	/*List apply(2);
-	apply[0] = func;
-	apply[1] = Value::Nil();
-	Prototype* p = Compiler::compile(thread, CreateCall(apply));
-	Thread ithread(state);
-	for(int64_t i = 0; i < x.length; i++) {
-		p->calls[0].arguments[0] = x[i];
-		r[i] = eval(ithread, p);
-	}*/
-
-	/*pthread_t h1, h2;
-
-	lapplyargs a1 = (lapplyargs) {0, x.length/2, thread, x, r, func};
-	lapplyargs a2 = (lapplyargs) {x.length/2, x.length, thread, x, r, func};
-
-        pthread_create (&h1, NULL, lapplybody, &a1);
-        pthread_create (&h2, NULL, lapplybody, &a2);
-	pthread_join(h1, NULL);
-	pthread_join(h2, NULL);
-	*/
-
-	mapplyargs a1 = (mapplyargs) {x, r, func};
-	thread.doall(mapplyheader, mapplybody, &a1, 0, r.length(), 1, 1); 
-
-	thread.gcStack.pop_back();
+	parallelApply(thread, x, args[1], r, len, -1);
+	result = r;
+}
+
+// Like lapply, but simplifies to a vector if every result has length 1.
+void sapply(Thread& thread, Value const* args, Value& result) {
+	lapply(thread, args, result);
+	List const& r = (List const&)result;
+	if(r.length() == 0)
+		return;
+	for(int64_t i = 0; i < r.length(); i++) {
+		if(!r[i].isVector() || r[i].isList() || ((Vector const&)r[i]).length() != 1)
+			return;
+	}
+	Type::Enum type = unlistType(thread, 1, r);
+	switch(type) {
+		#define CASE(Name) \
+			case Type::Name: { \
+				Name out(r.length()); \
+				int64_t i = 0; \
+				unlist(thread, 1, r, out, i); \
+				result = out; \
+			} break;
+		VECTOR_TYPES_NOT_NULL(CASE)
+		#undef CASE
+		default: break;
+	};
+}
+
+// Every result must look like args[2], so the result is allocated up front
+// and the threads write straight into it.
+void vapply(Thread& thread, Value const* args, Value& result) {
+	List x(1);
+	x[0] = args[0];
+	Value const& value = args[2];
+	if(!value.isVector() || value.isList() || value.isNull())
+		_error("FUN.VALUE must be an atomic vector");
+	int64_t width = ((Vector const&)value).length();
+	int64_t len = applyLength(x);
+	Value r;
+	switch(value.type()) {
+		#define CASE(Name) case Type::Name: r = Name(len*width); break;
+		VECTOR_TYPES_NOT_NULL(CASE)
+		#undef CASE
+		default: _error(std::string("NYI: vapply to ") + Type::toString(value.type())); break;
+	}
+	parallelApply(thread, x, args[1], r, len, width);
 	result = r;
 }
 
+// .ParFor(seq, body, reduce, multiple): body(seq[[i]]) for every i, in parallel, each
+// call in an environment of its own, with the results reduced by +, min, max or c.
+// The chunks don't depend on the number of threads, so neither does the result.
+void parfor(Thread& thread, Value const* args, Value& result) {
+	List x(1);
+	x[0] = args[0];
+	Character ops = As<Character>(thread, args[2]);
+	int64_t len = applyLength(x);
+
+	Value out = Null::Singleton();
+	applyargs a(thread, x, args[1], out, -1);
+	a.multiple = Logical::isTrue(As<Logical>(thread, args[3])[0]);
+	a.ppt = std::max((int64_t)1, (len+255) / 256);
+	// the partials stay rooted until they're reduced, or until the loop fails
+	size_t rooted = thread.gcStack.size();
+	List r(0);
+	try {
+		for(int64_t k = 0; k < ops.length(); k++) {
+			std::string op = thread.externStr(ops[k]);
+			if(op == "+") a.reductions.push_back(applyargs::ADD);
+			else if(op == "min") a.reductions.push_back(applyargs::MIN);
+			else if(op == "max") a.reductions.push_back(applyargs::MAX);
+			else if(op == "c") a.reductions.push_back(applyargs::CONCAT);
+			else _error(std::string("can't reduce with '") + op + "', use +, min, max or c");
+			int64_t slots = a.reductions.back() == applyargs::CONCAT ? len : (len+a.ppt-1) / a.ppt;
+			List p(slots);
+			for(int64_t i = 0; i < slots; i++)
+				p[i] = Value::Nil();
+			a.partials.push_back(p);
+			thread.gcStack.push_back(p);
+		}
+		if(a.reductions.empty())
+			_error("nothing to reduce");
+
+		parallelApply(thread, a, len);
+
+		r = List(a.reductions.size());
+		for(size_t k = 0; k < a.reductions.size(); k++) {
+			List const& p = a.partials[k];
+			if(a.reductions[k] == applyargs::CONCAT) {
+				Value v;
+				Value u[] = { p, Logical::False(), Logical::False() };
+				unlist(thread, u, v);
+				r[k] = v;
+			}
+			else {
+				Value v = Value::Nil();
+				for(int64_t i = 0; i < p.length(); i++)
+					if(!p[i].isNil())
+						reduce(thread, a.reductions[k], v, p[i], v);
+				r[k] = v.isNil() ? (Value)Null::Singleton() : v;
+			}
+		}
+	} catch(...) {
+		thread.gcStack.resize(rooted);
+		throw;
+	}
+	thread.gcStack.resize(rooted);
+	result = a.multiple ? (Value)r : r[0];
+}
+
 /*
 void tlist(Thread& thread, Value const* args, Value& result) {
 	int64_t length = args.length > 0 ? 1 : 0;
@@ -579,13 +771,112 @@ void proctime(Thread& thread, Value const* args, Value& result) {
 	result = Double::c(s/(1000000.0));
 }
 
+// 0 turns tracing off, 1 runs traces in the block interpreter, 2 compiles them.
+// Turning tracing off keeps the mode, so pending traces run the way they were recorded.
+// With deterministic=TRUE folds give the same bits however many threads run them.
 void traceconfig(Thread & thread, Value const* args, Value& result) {
-	Logical c = As<Logical>(thread, args[0]);
+	if(args[0].isLogical()) _error("trace mode must be 0, 1 or 2, not a logical");
+	Integer c = As<Integer>(thread, args[0]);
 	if(c.length() == 0) _error("condition is of zero length");
-	thread.state.epeeEnabled = Logical::isTrue(c[0]);
+	if(c[0] < 0 || c[0] > 2) _error("trace mode must be 0, 1 or 2");
+	thread.state.epeeEnabled = c[0] != 0;
+	if(c[0] != 0) thread.state.epeeCompile = c[0] != 1;
+	Integer min = As<Integer>(thread, args[1]);
+	Integer max = As<Integer>(thread, args[2]);
+	Double hysteresis = As<Double>(thread, args[3]);
+	Integer prefetch = As<Integer>(thread, args[4]);
+	Logical deterministic = As<Logical>(thread, args[5]);
+	if(min.length() == 0 || max.length() == 0 || hysteresis.length() == 0 || prefetch.length() == 0 || deterministic.length() == 0) _error("argument is of zero length");
+	if(min[0] < 0 || max[0] < min[0]) _error("invalid trace length thresholds");
+	if(hysteresis[0] < 1) _error("hysteresis must be at least 1");
+	if(prefetch[0] < 0) _error("prefetch distance must be non-negative");
+	thread.state.epeeMinLength = min[0];
+	thread.state.epeeMaxLength = max[0];
+	thread.state.epeeHysteresis = hysteresis[0];
+	thread.state.epeePrefetch = prefetch[0];
+	thread.state.epeeDeterministic = Logical::isTrue(deterministic[0]);
 	result = Null::Singleton();
 }
 
+// Columns of the telemetry kept for each site that recorded traces.
+void tracestats(Thread & thread, Value const* args, Value& result) {
+	typedef std::map<Instruction const*, TraceSite> Sites;
+	Sites const& sites = thread.traces.Sites();
+	int64_t n = 0;
+	for(Sites::const_iterator i = sites.begin(); i != sites.end(); ++i)
+		if(i->second.traces > 0) n++;
+
+	Character site(n);
+	Integer traces(n), recorded(n), optimized(n), elements(n), spills(n), launched(n);
+	Double compile(n), execute(n), bytes(n);
+	int64_t j = 0;
+	for(Sites::const_iterator i = sites.begin(); i != sites.end(); ++i) {
+		TraceSite const& s = i->second;
+		if(s.traces == 0) continue;
+		site[j] = thread.internStr(SiteName(s.source, s.pc));
+		traces[j] = s.traces;
+		recorded[j] = s.recorded;
+		optimized[j] = s.optimized;
+		compile[j] = s.compile * 1e9;
+		execute[j] = s.execute * 1e9;
+		elements[j] = s.elements;
+		spills[j] = s.spills;
+		bytes[j] = s.bytes;
+		launched[j] = s.launched;
+		j++;
+	}
+
+	List r(10);
+	r[0] = site;
+	r[1] = traces;
+	r[2] = recorded;
+	r[3] = optimized;
+	r[4] = compile;
+	r[5] = execute;
+	r[6] = elements;
+	r[7] = spills;
+	r[8] = bytes;
+	r[9] = launched;
+	result = r;
+}
+
+// Columns of each thread's scheduler counters, and its chunk duration histogram.
+void schedstats(Thread & thread, Value const* args, Value& result) {
+	std::vector<Thread*> const& threads = thread.state.threads;
+	int64_t n = threads.size();
+	Integer index(n), tasks(n), chunks(n), attempts(n), steals(n), parks(n);
+	Double busy(n), idle(n), parked(n);
+	Integer durations(n * SchedStats::Buckets);
+	double now = monotonic_time();
+	for(int64_t t = 0; t < n; t++) {
+		SchedStats const& s = threads[t]->sched;
+		index[t] = t;
+		tasks[t] = s.tasks;
+		chunks[t] = s.chunks;
+		attempts[t] = s.attempts;
+		steals[t] = s.steals;
+		parks[t] = s.parks;
+		busy[t] = s.busy * 1e9;
+		idle[t] = s.idleSoFar(now) * 1e9;
+		parked[t] = s.parkedSoFar(now) * 1e9;
+		for(int64_t b = 0; b < SchedStats::Buckets; b++)
+			durations[t * SchedStats::Buckets + b] = s.durations[b];
+	}
+
+	List r(10);
+	r[0] = index;
+	r[1] = tasks;
+	r[2] = chunks;
+	r[3] = attempts;
+	r[4] = steals;
+	r[5] = parks;
+	r[6] = busy;
+	r[7] = idle;
+	r[8] = parked;
+	r[9] = durations;
+	result = r;
+}
+
 // args( A, m, n, B, m, n )
 void matrixmultiply(Thread & thread, Value const* args, Value& result) {
 	double mA = asReal1(args[1]);
@@ -705,6 +996,10 @@ void registerCoreFunctions(State& state)
 	state.registerInternalFunction(state.internStr("source"), (source), 1);
 
 	state.registerInternalFunction(state.internStr("mapply"), (mapply), 2);
+	state.registerInternalFunction(state.internStr("lapply"), (lapply), 2);
+	state.registerInternalFunction(state.internStr("sapply"), (sapply), 2);
+	state.registerInternalFunction(state.internStr("vapply"), (vapply), 3);
+	state.registerInternalFunction(state.internStr("parfor"), (parfor), 4);
 	//state.registerInternalFunction(state.internStr("t.list"), (tlist));
 
 	state.registerInternalFunction(state.internStr("environment"), (environment), 1);
@@ -727,7 +1022,10 @@ void registerCoreFunctions(State& state)
 	state.registerInternalFunction(state.internStr("get"), (get), 4);
 
 	state.registerInternalFunction(state.internStr("proc.time"), (proctime), 0);
-	state.registerInternalFunction(state.internStr("trace.config"), (traceconfig), 1);
+	state.registerInternalFunction(state.internStr("trace.config"), (traceconfig), 6);
+	state.registerInternalFunction(state.internStr("trace.stats"), (tracestats), 0);
+	state.registerInternalFunction(state.internStr("sched.stats"), (schedstats), 0);
+	state.registerInternalFunction(state.internStr("set.seed"), (setseed), 1);
 	
 	state.registerInternalFunction(state.internStr("read.table"), (readtable), 3);
 	
@@ -2,6 +2,8 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <fstream>
+#include <malloc.h>
 
 #include "value.h"
 #include "type.h"
@@ -9,6 +11,7 @@
 #include "ops.h"
 #include "runtime.h"
 #include "interpreter.h"
+#include "epee/moments.h"
 #include "compiler.h"
 #include "sse.h"
 #include "call.h"
@@ -385,6 +388,8 @@ static inline Instruction const* eassign_op(Thread& thread, Instruction const& i
 	DECODE(a); FORCE(a);
 	DECODE(b); FORCE(b); BIND(b);
 	DECODE(c); FORCE(c);
+	// can't record a store into the result of a trace that's still running
+	if(thread.traces.isRunning(c)) { BIND(c); }
 
 	if(a.isFuture() && (c.isVector() || c.isFuture())) {
 		if(b.isInteger() && ((Integer const&)b).length() == 1) {
@@ -522,12 +527,20 @@ static inline Instruction const* Name##_op(Thread& thread, Instruction const& in
 	if(a.isInteger1()) { Name##VOp<Integer>::Scalar(thread, a.i, c); return &inst+1; } \
 	if(a.isLogical1()) { Name##VOp<Logical>::Scalar(thread, a.c, c); return &inst+1; } \
 	FORCE(a); \
-	if(thread.traces.isTraceable<Group>(a)) { \
+	if(thread.traces.isTraceable<Group>(a) && thread.traces.isProfitable(thread, inst, a)) { \
 		c = thread.traces.EmitUnary<Group>(thread.frame.environment, IROpCode::Name, a, 0); \
 		thread.traces.OptBind(thread, c); \
  		return &inst+1; \
 	} \
 	BIND(a); \
+	/* an untraced split, each group is folded on its own */ \
+	if(a.isList() && className((Object const&)a) == Strings::split) { \
+		List const& g = (List const&)a; \
+		List r(g.length()); \
+		for(int64_t i = 0; i < g.length(); i++) Group##Dispatch<Name##VOp>(thread, g[i], r[i]); \
+		Unsplit(thread, r, c); \
+		return &inst+1; \
+	} \
 	if(((Object const&)a).hasAttributes()) { return GenericDispatch(thread, inst, Strings::Name, a, inst.c); } \
 \
 	Group##Dispatch<Name##VOp>(thread, a, c); \
@@ -558,11 +571,13 @@ static inline Instruction const* Name##_op(Thread& thread, Instruction const& in
 		if(b.isLogical1()) { Name##VOp<Logical,Logical>::Scalar(thread, a.c, b.c, c); return &inst+1; } \
         } \
 	FORCE(a); FORCE(b); \
-	if(thread.traces.isTraceable<Group>(a,b)) { \
+	if(thread.traces.isTraceable<Group>(a,b) && thread.traces.isProfitable(thread, inst, a, b)) { \
 		c = thread.traces.EmitBinary<Group>(thread.frame.environment, IROpCode::Name, a, b, 0); \
 		thread.traces.OptBind(thread, c); \
 		return &inst+1; \
 	} \
+	/* bind a shorter future (e.g. a fold) on its own, the longer trace can keep recording with its result */ \
+	if(a.isFuture() && b.isFuture() && thread.traces.futureShape(b).length < thread.traces.futureShape(a).length) { BIND(b); } \
 	BIND(a); BIND(b); \
 	if(((Object const&)a).hasAttributes() || ((Object const&)b).hasAttributes()) { return GenericDispatch(thread, inst, Strings::Name, a, b, inst.c); } \
 \
@@ -580,6 +595,8 @@ static inline Instruction const* length_op(Thread& thread, Instruction const& in
 		IRNode::Shape shape = thread.traces.futureShape(a);
 		if(shape.split < 0 && shape.filter < 0) {
 			Integer::InitScalar(OUT(c), shape.length);
+		} else if(!thread.traces.isLoadable(a)) {
+			BIND(a);
 		} else {
 			OUT(c) = thread.traces.EmitUnary<CountFold>(thread.frame.environment, IROpCode::length, a, 0);
 			thread.traces.OptBind(thread, OUT(c));
@@ -617,6 +634,25 @@ static inline Instruction const* cm2_op(Thread& thread, Instruction const& inst)
 	return &inst+1;
 }
 
+static inline Instruction const* moments_op(Thread& thread, Instruction const& inst) {
+	DECODE(a); FORCE(a);
+	if(thread.traces.isTraceable<MomentsFold>(a)) {
+		OUT(c) = thread.traces.EmitUnary<MomentsFold>(thread.frame.environment, IROpCode::moments, a, 0);
+		thread.traces.OptBind(thread, OUT(c));
+		return &inst+1;
+	}
+	BIND(a);
+	Double x = As<Double>(thread, a);
+	double m[Moments::Width];
+	Moments::init(m);
+	for(int64_t i = 0; i < x.length(); i++)
+		Moments::add(m, x[i]);
+	Double r(Moments::Stats);
+	Moments::result(m, r.v());
+	OUT(c) = r;
+	return &inst+1;
+}
+
 static inline Instruction const* ifelse_op(Thread& thread, Instruction const& inst) {
 	DECODE(a); FORCE(a);
 	DECODE(b); FORCE(b);
@@ -656,7 +692,12 @@ static inline Instruction const* split_op(Thread& thread, Instruction const& ins
 	}
 	BIND(a); BIND(b); BIND(c);
 
-	_error("split not defined in scalar yet");
+	// marked so folds know to fold each group rather than the list
+	List r = SplitSlow(thread, c, As<Integer>(thread, b), levels);
+	Dictionary* d = new Dictionary(1);
+	d->insert(Strings::classSym) = Character::c(Strings::split);
+	r.attributes(d);
+	OUT(c) = r;
 	return &inst+1; 
 }
 
@@ -673,10 +714,7 @@ static inline Instruction const* vector_op(Thread& thread, Instruction const& in
 	Type::Enum type = string2Type( As<Character>(thread, a)[0] );
 	int64_t l = As<Integer>(thread, b)[0];
 	
-	// TODO: replace with isTraceable...
-	if(thread.state.epeeEnabled 
-		&& (type == Type::Double || type == Type::Integer || type == Type::Logical)
-		&& l >= TRACE_VECTOR_WIDTH) {
+	if(thread.traces.isProfitable(thread, inst, type, l)) {
 		OUT(c) = thread.traces.EmitConstant(thread.frame.environment, type, l, 0);
 		thread.traces.OptBind(thread, OUT(c));
 		return &inst+1;
@@ -718,7 +756,7 @@ static inline Instruction const* seq_op(Thread& thread, Instruction const& inst)
 	double step = As<Double>(thread, b)[0];
 	int64_t len = As<Integer>(thread, a)[0];
 	
-	if(len >= TRACE_VECTOR_WIDTH) {
+	if(thread.traces.isProfitable(thread, inst, b.isDouble() || c.isDouble() ? Type::Double : Type::Integer, len)) {
 		if(b.isDouble() || c.isDouble()) {
 			OUT(c) = thread.traces.EmitSequence(thread.frame.environment, len, start, step);
 			thread.traces.OptBind(thread, OUT(c));
@@ -746,7 +784,7 @@ static inline Instruction const* index_op(Thread& thread, Instruction const& ins
 	int64_t each = As<Integer>(thread, b)[0];
 	int64_t len = As<Integer>(thread, a)[0];
 	
-	if(len >= TRACE_VECTOR_WIDTH) {
+	if(thread.traces.isProfitable(thread, inst, Type::Integer, len)) {
 		OUT(c) = thread.traces.EmitIndex(thread.frame.environment, len, (int64_t)n, (int64_t)each);
 		thread.traces.OptBind(thread, OUT(c));
 		return &inst+1;
@@ -760,14 +798,15 @@ static inline Instruction const* random_op(Thread& thread, Instruction const& in
 	DECODE(a); FORCE(a); BIND(a);
 
 	int64_t len = As<Integer>(thread, a)[0];
+	int64_t stream = fetch_and_add(&thread.state.random.stream, 1);
 	
-	/*if(len >= TRACE_VECTOR_WIDTH) {
-		OUT(c) = thread.EmitRandom(thread.frame.environment, len);
-		thread.OptBind(OUT(c));
+	if(thread.traces.isProfitable(thread, inst, Type::Double, len)) {
+		OUT(c) = thread.traces.EmitRandom(thread.frame.environment, len, thread.state.random.seed, stream);
+		thread.traces.OptBind(thread, OUT(c));
 		return &inst+1;
-	}*/
+	}
 
-	OUT(c) = RandomVector(thread, len);
+	OUT(c) = RandomVector(thread, len, stream);
 	return &inst+1;
 }
 
@@ -871,6 +910,9 @@ Value Thread::eval(Prototype const* prototype, Environment* environment) {
 		assert(stackSize == stack.size());
 		return frame.registers[0];
 	} catch(...) {
+		// unwind to the caller's frame, so a collection doesn't walk the failed call's registers
+		if(stack.size() > stackSize)
+			frame = stack[stackSize];
 		stack.resize(stackSize);
 		throw;
 	}
@@ -879,25 +921,131 @@ Value Thread::eval(Prototype const* prototype, Environment* environment) {
 
 
 
-const int64_t Random::primes[100] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43,
-47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
-137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
-227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311,
-313, 317, 331, 337, 347, 349, 353, 359, 367, 373, 379, 383, 389, 397, 401, 409,
-419, 421, 431, 433, 439, 443, 449, 457, 461, 463, 467, 479, 487, 491, 499, 503,
-509, 521, 523, 541};
+
+const double Thread::POST_GRACE = 2e-4;
 
 Thread::Thread(State& state, uint64_t index) 
     : state(state)
     , index(index)
 #ifdef EPEE
-    , traces(state.epeeEnabled)
+    , traces(state.epeeEnabled, state.epeeMinLength)
 #endif
-    , random(index) 
     , steals(1)
+    , victims(0x9E3779B97F4A7C15ULL * (index+1))
+    , posts(0)
+    , depth(0)
 {
 	registers = new Value[DEFAULT_NUM_REGISTERS];
 	frame.registers = registers;
+	frame.environment = 0;
+	frame.prototype = 0;
+}
+
+// The nodes memory can be allocated on, as a bit mask, from e.g. "0-1,4".
+static unsigned long OnlineNodes() {
+	std::ifstream in("/sys/devices/system/node/online");
+	unsigned long nodes = 0;
+	int64_t first, last;
+	while(in >> first) {
+		last = first;
+		if(in.peek() == '-') {
+			in.get();
+			in >> last;
+		}
+		for(int64_t i = first; i <= last && i < (int64_t)sizeof(nodes)*8; i++)
+			nodes |= 1UL << i;
+		if(in.peek() == ',')
+			in.get();
+	}
+	return nodes;
+}
+
+void State::place() {
+#ifdef __linux__
+	if(placement == PlaceFirstTouch) {
+		// a fixed threshold, so big vectors always get fresh pages from mmap
+		// rather than reusing ones first touched by whoever had them before
+		mallopt(M_MMAP_THRESHOLD, 1 << 20);
+	}
+	else if(placement == PlaceInterleave) {
+		static const int MPOL_INTERLEAVE = 3;
+		unsigned long nodes = OnlineNodes();
+		if(nodes != 0 && syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &nodes, sizeof(nodes)*8+1) != 0)
+			_error("can't interleave memory over the NUMA nodes");
+	}
+#endif
+}
+
+void State::pin(Thread& thread) {
+#ifdef __linux__
+	if(!affinity)
+		return;
+	// read before the main thread is pinned, or it'd be all we're allowed on
+	static cpu_set_t allowed;
+	static bool read = false;
+	if(!read && sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		_error("can't read the cpu affinity mask");
+	read = true;
+	int64_t n = CPU_COUNT(&allowed);
+	int64_t k = thread.index % n;
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(CPU_ISSET(cpu, &allowed) && k-- == 0) {
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			if(pthread_setaffinity_np(thread.thread, sizeof(one), &one) != 0)
+				_error("can't pin thread to a cpu");
+			return;
+		}
+	}
+#endif
+}
+
+// Every thread's chunks, parks and steals as a Chrome trace (chrome://tracing or
+// ui.perfetto.dev), with each thread's counters alongside.
+void State::writeTimeline(std::ostream& out) const {
+	static char const* names[] = { "chunk", "parked", "steal" };
+	out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+	bool first = true;
+	for(uint64_t t = 0; t < threads.size(); t++) {
+		out << (first ? "\n" : ",\n");
+		first = false;
+		out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t
+			<< ", \"args\": {\"name\": \"thread " << t << "\"}}";
+		std::vector<SchedStats::Event> const& timeline = threads[t]->sched.timeline;
+		for(size_t i = 0; i < timeline.size(); i++) {
+			SchedStats::Event const& e = timeline[i];
+			out << ",\n  {\"name\": \"" << names[e.kind] << "\", \"pid\": 1, \"tid\": " << t
+				<< ", \"ts\": " << e.start * 1e6;
+			if(e.kind == SchedStats::Event::STEAL)
+				out << ", \"ph\": \"i\", \"s\": \"t\", \"args\": {\"from\": " << e.a << "}}";
+			else if(e.kind == SchedStats::Event::CHUNK)
+				out << ", \"ph\": \"X\", \"dur\": " << e.duration * 1e6
+					<< ", \"args\": {\"a\": " << e.a << ", \"b\": " << e.b << "}}";
+			else
+				out << ", \"ph\": \"X\", \"dur\": " << e.duration * 1e6 << "}";
+		}
+	}
+	out << "\n], \"threads\": [";
+	double now = monotonic_time();
+	for(uint64_t t = 0; t < threads.size(); t++) {
+		SchedStats const& s = threads[t]->sched;
+		out << (t == 0 ? "\n" : ",\n");
+		out << "  {\"thread\": " << t
+			<< ", \"tasks\": " << s.tasks
+			<< ", \"chunks\": " << s.chunks
+			<< ", \"steal_attempts\": " << s.attempts
+			<< ", \"steals\": " << s.steals
+			<< ", \"parks\": " << s.parks
+			<< ", \"busy_ns\": " << (int64_t)(s.busy * 1e9)
+			<< ", \"idle_ns\": " << (int64_t)(s.idleSoFar(now) * 1e9)
+			<< ", \"parked_ns\": " << (int64_t)(s.parkedSoFar(now) * 1e9)
+			<< ", \"chunk_ns_log2\": [";
+		for(int64_t b = 0; b < SchedStats::Buckets; b++)
+			out << (b > 0 ? ", " : "") << s.durations[b];
+		out << "]}";
+	}
+	out << "\n]}\n";
 }
 
 void Prototype::printByteCode(Prototype const* prototype, State const& state) {
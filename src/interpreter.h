@@ -23,31 +23,47 @@ void marker(char* a);
 ///////////////////////////////////////////////////////////////////
 
 
-// TODO: Make this use a good concurrent map implementation 
+// Interned strings, so equal strings are the same String and compare by pointer.
+// Sharded by hash, so threads interning at once rarely meet on a lock. Each shard
+// is an open addressing table over the strings' bytes, and keeps the strings in
+// big append-only arenas. Lookups don't allocate. Strings are never freed.
 class StringTable {
-	std::map<std::string, String> stringTable;
-	Lock lock;
-public:
-	StringTable() {
-	#define ENUM_STRING_TABLE(name, string) \
-		stringTable[string] = Strings::name; 
-		STRINGS(ENUM_STRING_TABLE);
+	static const uint64_t SHARD_BITS = 6;
+	static const uint64_t SHARDS = 1 << SHARD_BITS;
+	static const uint64_t ARENA = 1 << 16;
+
+	struct Slot {
+		uint64_t hash;
+		String s;
+	};
+
+	struct Shard {
+		Lock lock;
+		Slot* slots;
+		uint64_t size, count;	// size is a power of 2, and it's kept at most half full
+		char* arena, *end;
+		char padding[64];	// keep the locks off each other's cache lines
+	};
+	Shard shards[SHARDS];
+
+	// the top bits pick the shard, the bottom ones the slot
+	Shard& shardOf(uint64_t h) {
+		return shards[h >> (64 - SHARD_BITS)];
 	}
 
+	static uint64_t hash(char const* s, size_t n);
+	void put(String s);
+	Slot& find(Shard& shard, uint64_t h, char const* s, size_t n);
+	char* copy(Shard& shard, char const* s, size_t n);
+	void grow(Shard& shard);
+
+public:
+	StringTable();
+
+	String in(char const* s, size_t n);
+
 	String in(std::string const& s) {
-		lock.acquire();
-		std::map<std::string, String>::const_iterator i = stringTable.find(s);
-		if(i == stringTable.end()) {
-			char* str = new char[s.size()+1];
-			memcpy(str, s.c_str(), s.size()+1);
-			String string = (String)str;
-			stringTable[s] = string;
-			lock.release();
-			return string;
-		} else {
-			lock.release();
-			return i->second;
-		}
+		return in(s.c_str(), s.size());
 	}
 
 	std::string out(String s) const {
@@ -126,26 +142,60 @@ public:
 	Environment* global;
 
 	std::vector<Thread*> threads;
+	EventCount events;	// idle threads park here until work is queued or a task finishes
 
 	bool verbose;
 	bool epeeEnabled;
+	bool epeeCompile;	// JIT traces, or run them in the block interpreter
+	int64_t epeeMinLength;	// shorter vectors are never recorded
+	int64_t epeeMaxLength;	// longer vectors always are
+	double epeeHysteresis;	// how much better recording must look before a site changes its mind
+	int64_t epeePrefetch;	// how many elements ahead gathers prefetch, 0 to turn it off
+	bool epeeDeterministic;	// folds merge fixed chunks in a fixed order, so results don't depend on the threads
+
+	Random random;
 
     enum Format {
         RiposteFormat,
         RFormat
     };
     Format format;
+
+    // tell profilers what the JIT'd traces are
+    enum PerfOutput {
+        PerfNone,
+        PerfMap,        // /tmp/perf-<pid>.map
+        PerfJitDump     // /tmp/jit-<pid>.dump, with each trace's IR as its source
+    };
+    PerfOutput perf;
+
+    bool schedTrace;        // keep every thread's timeline for --sched-trace
+    double started;         // monotonic_time() when we started
+
+    // where big vectors' pages end up on NUMA machines
+    enum Placement {
+        PlaceNone,
+        PlaceFirstTouch,    // each thread always gets the same slice of a doall, so it's the first to touch it
+        PlaceInterleave     // pages are spread round robin over the nodes
+    };
+    Placement placement;
+    bool affinity;          // pin thread i to the i-th cpu we're allowed on
     
     int64_t done;
 	
     Character arguments;
 
-	State(uint64_t threads, int64_t argc, char** argv);
+	State(uint64_t threads, int64_t argc, char** argv, bool affinity = false, Placement placement = PlaceNone);
 
 	~State() {
 		fetch_and_add(&done, 1);
+		events.notify();
 		while(fetch_and_add(&done, 0) != (int64_t)threads.size()) { 
-			sleep(); 
+			int32_t key = events.prepare();
+			if(fetch_and_add(&done, 0) != (int64_t)threads.size())
+				events.wait(key);
+			else
+				events.cancel();
 		}
 	}
 
@@ -161,14 +211,21 @@ public:
 	}
 
 	void interpreter_init(Thread& state);
+	void place();
+	void pin(Thread& thread);
+	void writeTimeline(std::ostream& out) const;
 	
 	std::string stringify(Value const& v) const;
 	std::string deparse(Value const& v) const;
 
-	String internStr(std::string s) {
+	String internStr(std::string const& s) {
 		return strings.in(s);
 	}
 
+	String internStr(char const* s, size_t n) {
+		return strings.in(s, n);
+	}
+
 	std::string externStr(String s) const {
 		return strings.out(s);
 	}
@@ -178,12 +235,66 @@ public:
 // Per-thread state 
 ///////////////////////////////////////////////////////////////////
 
+// What the scheduler did on one thread, for sched.stats() and --sched-trace.
+struct SchedStats {
+	// chunk durations, bucket b counts chunks that took [2^b, 2^(b+1)) ns
+	static const int64_t Buckets = 32;
+
+	struct Event {
+		enum Kind { CHUNK, PARK, STEAL };
+		Kind kind;
+		double start, duration;	// seconds since the State started
+		uint64_t a, b;	// the chunk's range, or the thread stolen from
+	};
+
+	int64_t tasks, chunks, attempts, steals, parks;
+	double busy, idle, parked;	// seconds
+	double idleSince, parkedSince;	// when the current idle stretch or park started, or 0
+	int64_t durations[Buckets];
+	std::vector<Event> timeline;	// only kept with --sched-trace
+
+	SchedStats() : tasks(0), chunks(0), attempts(0), steals(0), parks(0), busy(0), idle(0), parked(0), idleSince(0), parkedSince(0) {
+		for(int64_t i = 0; i < Buckets; i++)
+			durations[i] = 0;
+	}
+
+	// including a stretch that's still going on
+	double idleSoFar(double now) const { 
+		double since = idleSince;
+		return idle + (since > 0 ? now - since : 0);
+	}
+	double parkedSoFar(double now) const { 
+		double since = parkedSince;
+		return parked + (since > 0 ? now - since : 0);
+	}
+
+	void chunk(double start, double end) {
+		chunks++;
+		busy += end - start;
+		int64_t ns = (int64_t)((end - start) * 1e9);
+		int64_t b = 0;
+		while(ns > 1 && b < Buckets-1) {
+			ns >>= 1;
+			b++;
+		}
+		durations[b]++;
+	}
+
+	void record(Event::Kind kind, double start, double end, uint64_t a, uint64_t b) {
+		Event e = { kind, start, end - start, a, b };
+		timeline.push_back(e);
+	}
+};
+
 class Thread {
 public:
 	struct Task {
 		typedef void* (*HeaderPtr)(void* args, uint64_t a, uint64_t b, Thread& thread);
 		typedef void (*FunctionPtr)(void* args, void* header, uint64_t a, uint64_t b, Thread& thread);
 
+		// urgent tasks (the traces the interpreter is waiting on) are run and stolen before bulk ones
+		enum Priority { BULK, URGENT };
+
 		HeaderPtr header;
 		FunctionPtr func;
 		void* args;
@@ -192,9 +303,11 @@ public:
 		uint64_t alignment;
 		uint64_t ppt;
 		int64_t* done;
-		Task() : header(0), func(0), args(0), a(0), b(0), alignment(0), ppt(0), done(0) {}
-		Task(HeaderPtr header, FunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment, uint64_t ppt) 
-			: header(header), func(func), args(args), a(a), b(b), alignment(alignment), ppt(ppt) {
+		int64_t depth;	// how deeply nested in other tasks the doall that made it was
+		Priority priority;
+		Task() : header(0), func(0), args(0), a(0), b(0), alignment(0), ppt(0), done(0), depth(0), priority(URGENT) {}
+		Task(HeaderPtr header, FunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment, uint64_t ppt, int64_t depth, Priority priority) 
+			: header(header), func(func), args(args), a(a), b(b), alignment(alignment), ppt(ppt), depth(depth), priority(priority) {
 			done = new int64_t(1);
 		}
 	};
@@ -216,10 +329,23 @@ public:
 	Traces traces;
 #endif
 
-	std::deque<Task> tasks;
-	Lock tasksLock;
-	Random random;	
+	WorkDeque<Task> urgent;
+	WorkDeque<Task> tasks;
 	int64_t steals;
+	uint64_t victims;	// xorshift state for picking who to steal from
+
+	SchedStats sched;
+
+	// slices of doalls dealt to this thread, see slice(), and when they were
+	struct Post {
+		Task task;
+		double at;
+	};
+	std::vector<Post> posted;
+	Lock postLock;
+	int64_t posts;
+
+	int64_t depth;	// of the tasks doalls started here make, one more than the task running, if any
 
 	int64_t assignment[64], set[64]; // temporary space for matching arguments
 	
@@ -237,7 +363,8 @@ public:
 
 	std::string stringify(Value const& v) const { return state.stringify(v); }
 	std::string deparse(Value const& v) const { return state.deparse(v); }
-	String internStr(std::string s) { return state.internStr(s); }
+	String internStr(std::string const& s) { return state.internStr(s); }
+	String internStr(char const* s, size_t n) { return state.internStr(s, n); }
 	std::string externStr(String s) const { return state.externStr(s); }
 
 	static void* start(void* ptr) {
@@ -249,29 +376,95 @@ public:
 	Value eval(Prototype const* prototype, Environment* environment); 
 	Value eval(Prototype const* prototype);
 	
-	void doall(Task::HeaderPtr header, Task::FunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment=1, uint64_t ppt = 1) {
+	// Runs func over [a, b) on all the threads and returns once it's done. doalls may nest,
+	// e.g. a trace inside a parallel apply. While it waits, a thread only helps with tasks
+	// at least as deeply nested as its own, so it never starts outer work that could keep
+	// it from returning.
+	void doall(Task::HeaderPtr header, Task::FunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment=1, uint64_t ppt = 1, Task::Priority priority = Task::URGENT) {
 		if(a < b && func != 0) {
 			uint64_t tmp = ppt+alignment-1;
 			ppt = std::max((uint64_t)1, tmp - (tmp % alignment));
 
-			Task t(header, func, args, a, b, alignment, ppt);
+			Task t(header, func, args, a, b, alignment, ppt, depth, priority);
+			if(state.placement == State::PlaceFirstTouch)
+				slice(t);
+			// parked threads only ask for a share of the range once they're awake
+			state.events.notify();
 			run(t);
-	
-			while(fetch_and_add(t.done, 0) != 0) {
-				Task s;
-				if(dequeue(s) || steal(s)) run(s);
-				else sleep(); 
-			}
+			wait(t.done, t.depth);
+			delete t.done;
 		}
 	}
 
+	// Like doall, but only queues the work for the other threads to steal and returns immediately.
+	// Returns the task's completion counter which must be passed to join.
+	// Nothing waits on it until the join, so it's bulk work unless asked otherwise.
+	int64_t* spawn(Task::HeaderPtr header, Task::FunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment=1, uint64_t ppt = 1, Task::Priority priority = Task::BULK) {
+		uint64_t tmp = ppt+alignment-1;
+		ppt = std::max((uint64_t)1, tmp - (tmp % alignment));
+
+		Task t(header, func, args, a, b, alignment, ppt, depth, priority);
+		if(a >= b || func == 0)
+			fetch_and_add(t.done, -1);
+		else {
+			queue(t);
+			// one task, one thread to take it
+			state.events.notify(1);
+		}
+		return t.done;
+	}
+
+	// Wait for spawned work to finish, helping out in the meantime.
+	void join(int64_t* done) {
+		wait(done, depth);
+		delete done;
+	}
+
 private:
+	// failed attempts to find work before an idle thread starts yielding, and before it parks
+	static const int64_t SPINS = 64;
+	static const int64_t YIELDS = 256;
+	// how long a slice posted to a thread is left for it before others may take it
+	static const double POST_GRACE;
+
+	void idle(int64_t spins) {
+		if(spins < SPINS) cpu_relax();
+		else sched_yield();
+	}
+
+	void wait(int64_t* done, int64_t depth) {
+		int64_t spins = 0;
+		while(fetch_and_add(done, 0) != 0) {
+			Task s;
+			if(dequeue(s, depth) || steal(s, depth)) {
+				if(spins > 0) awake();
+				run(s);
+				spins = 0;
+			}
+			else {
+				if(spins == 0) asleep();
+				if(++spins < YIELDS) idle(spins);
+				else {
+					int32_t key = state.events.prepare();
+					if(fetch_and_add(done, 0) != 0 && !queued())
+						park(key);
+					else
+						state.events.cancel();
+				}
+			}
+		}
+		if(spins > 0) awake();
+	}
+
 	void loop() {
+		int64_t spins = 0;
 		while(fetch_and_add(&(state.done), 0) == 0) {
 			// pull stuff off my queue and run
 			// or steal and run
 			Task s;
-			if(dequeue(s) || steal(s)) {
+			if(dequeue(s, 0) || steal(s, 0)) {
+				if(spins > 0) awake();
+				spins = 0;
 				try {
 					run(s);
 				} catch(RiposteError& error) {
@@ -281,12 +474,61 @@ private:
 				} catch(CompileError& error) {
 					printf("Error (compiler:%d): %s\n", (int)index, error.what().c_str());
 				}
-			} else sleep(); 
+			}
+			else {
+				if(spins == 0) asleep();
+				if(++spins < YIELDS) idle(spins);
+				else {
+					int32_t key = state.events.prepare();
+					if(fetch_and_add(&(state.done), 0) == 0 && !queued())
+						park(key);
+					else
+						state.events.cancel();
+				}
+			}
 		}
 		fetch_and_add(&(state.done), 1);
+		state.events.notify();
+	}
+
+	// An idle stretch runs from the first failed attempt to find work to the next success.
+	// Time spent parked in it is counted separately.
+	void asleep() {
+		sched.idleSince = monotonic_time();
+	}
+
+	void awake() {
+		sched.idle += monotonic_time() - sched.idleSince;
+		sched.idleSince = 0;
+	}
+
+	void park(int32_t key) {
+		double start = monotonic_time();
+		sched.idle += start - sched.idleSince;
+		sched.idleSince = 0;
+		sched.parkedSince = start;
+		state.events.wait(key);
+		double end = monotonic_time();
+		sched.parks++;
+		sched.parked += end - start;
+		sched.parkedSince = 0;
+		sched.idleSince = end;
+		if(state.schedTrace)
+			sched.record(SchedStats::Event::PARK, start - state.started, end - state.started, 0, 0);
+	}
+
+	// is there anything posted to any thread or in any thread's deque
+	bool queued() const {
+		for(uint64_t i = 0; i < state.threads.size(); i++)
+			if(state.threads[i]->posts > 0 || !state.threads[i]->urgent.empty() || !state.threads[i]->tasks.empty())
+				return true;
+		return false;
 	}
 
 	void run(Task& t) {
+		sched.tasks++;
+		int64_t outer = depth;
+		depth = t.depth+1;
 		void* h = t.header != NULL ? t.header(t.args, t.a, t.b, *this) : 0;
 		while(t.a < t.b) {
 			// check if we need to relinquish some of our chunk...
@@ -303,17 +545,24 @@ private:
 				}
 				if(n.a < n.b) {
 					//printf("Thread %d relinquishing %d (%d %d)\n", index, n.b-n.a, t.a, t.b);
-					tasksLock.acquire();
 					fetch_and_add(t.done, 1); 
-					tasks.push_front(n);
-					tasksLock.release();
+					queue(n);
+					state.events.notify(1);
 				}
 			}
-			t.func(t.args, h, t.a, std::min(t.a+t.ppt,t.b), *this);
+			uint64_t end = std::min(t.a+t.ppt,t.b);
+			double start = monotonic_time();
+			t.func(t.args, h, t.a, end, *this);
+			double finish = monotonic_time();
+			sched.chunk(start, finish);
+			if(state.schedTrace)
+				sched.record(SchedStats::Event::CHUNK, start - state.started, finish - state.started, t.a, end);
 			t.a += t.ppt;
 		}
 		//printf("Thread %d finished %d %d (%d)\n", index, t.a, t.b, t.done);
-		fetch_and_add(t.done, -1);
+		depth = outer;
+		if(fetch_and_add(t.done, -1) == 1)
+			state.events.notify();
 	}
 
 	uint64_t split(Task const& t) {
@@ -325,42 +574,132 @@ private:
 		return half;
 	}
 
-	bool dequeue(Task& out) {
-		tasksLock.acquire();
-		if(tasks.size() >= 1) {
-			out = tasks.front();
-			tasks.pop_front();
-			tasksLock.release();
-			return true;
+	// Deal the range out in equal, fixed slices, one per thread. The same range
+	// always goes to the same threads, so a trace reading another's output
+	// mostly reads pages its own thread wrote, and first touched, earlier.
+	// A slice its thread hasn't started within POST_GRACE may be stolen, so one
+	// busy with something long doesn't hold up the doall.
+	void slice(Task& t) {
+		uint64_t n = state.threads.size();
+		if(n < 2 || (t.b-t.a) < n*t.ppt)
+			return;
+		uint64_t a = t.a, b = t.b;
+		for(uint64_t i = 0; i < n; i++) {
+			Task s = t;
+			s.a = bound(a, b, t.alignment, i, n);
+			s.b = bound(a, b, t.alignment, i+1, n);
+			if(i == index) {
+				t.a = s.a;
+				t.b = s.b;
+			}
+			else if(s.a < s.b) {
+				fetch_and_add(t.done, 1);
+				state.threads[i]->post(s);
+			}
 		}
-		tasksLock.release();
+	}
+
+	static uint64_t bound(uint64_t a, uint64_t b, uint64_t alignment, uint64_t i, uint64_t n) {
+		if(i == n)
+			return b;
+		uint64_t r = a + (b-a)*i/n;
+		r -= r % alignment;
+		return std::max(r, a);
+	}
+
+	void post(Task const& t) {
+		Post p = { t, monotonic_time() };
+		postLock.acquire();
+		posted.push_back(p);
+		fetch_and_add(&posts, 1);
+		postLock.release();
+	}
+
+	void queue(Task const& t) {
+		if(t.priority == Task::URGENT)
+			urgent.push(t);
+		else
+			tasks.push(t);
+	}
+
+	struct Nested {
+		int64_t depth;
+		Nested(int64_t depth) : depth(depth) {}
+		bool operator()(Task const& t) const { return t.depth >= depth; }
+	};
+
+	// pops the newest task, unless it's less deeply nested than depth
+	static bool pop(WorkDeque<Task>& deque, Task& out, int64_t depth) {
+		if(!deque.pop(out))
+			return false;
+		if(out.depth >= depth)
+			return true;
+		deque.push(out);
 		return false;
 	}
 
-	bool steal(Task& out) {
-		// check other threads for available tasks, don't check myself.
-		bool found = false;
-		for(uint64_t i = 0; i < state.threads.size() && !found; i++) {
-			if(i != index) {
-				Thread& t = *(state.threads[i]);
-				t.tasksLock.acquire();
-				if(t.tasks.size() > 0) {
-					out = t.tasks.back();
-					t.tasks.pop_back();
-					t.tasksLock.release();
-					found = true;
-				} else {
-					fetch_and_add(&t.steals,1);
-					t.tasksLock.release();
+	// takes a posted slice nested at least depth deep, for the owner the newest one,
+	// for a thief the oldest that was posted before `before`
+	bool unpost(Task& out, int64_t depth, bool owner, double before) {
+		if(fetch_and_add(&posts, 0) == 0)
+			return false;
+		postLock.acquire();
+		int64_t found = -1;
+		for(int64_t i = 0; i < (int64_t)posted.size(); i++) {
+			int64_t j = owner ? posted.size()-1-i : i;
+			if(posted[j].task.depth >= depth && (owner || posted[j].at < before)) {
+				found = j;
+				break;
+			}
+		}
+		if(found >= 0) {
+			out = posted[found].task;
+			posted.erase(posted.begin() + found);
+			fetch_and_add(&posts, -1);
+		}
+		postLock.release();
+		return found >= 0;
+	}
+
+	bool dequeue(Task& out, int64_t depth) {
+		return unpost(out, depth, true, 0) || pop(urgent, out, depth) || pop(tasks, out, depth);
+	}
+
+	bool steal(Task& out, int64_t depth) {
+		// check the other threads for available tasks, starting from a random one so thieves spread out,
+		// urgent ones first
+		uint64_t n = state.threads.size();
+		if(n < 2)
+			return false;
+		victims ^= victims << 13;
+		victims ^= victims >> 7;
+		victims ^= victims << 17;
+		uint64_t first = victims % n;
+		double before = monotonic_time() - POST_GRACE;
+		for(uint64_t i = 0; i < 2*n; i++) {
+			uint64_t v = (first + i) % n;
+			if(v != index) {
+				Thread& t = *(state.threads[v]);
+				sched.attempts++;
+				if((i < n && t.unpost(out, depth, false, before)) || (i < n ? t.urgent : t.tasks).steal(out, Nested(depth))) {
+					sched.steals++;
+					if(state.schedTrace) {
+						double now = monotonic_time() - state.started;
+						sched.record(SchedStats::Event::STEAL, now, now, v, 0);
+					}
+					return true;
 				}
+				// tell the victim someone is idle so it splits its running task
+				if(i >= n)
+					fetch_and_add(&t.steals,1);
 			}
 		}
-		return found;
+		return false;
 	}
 };
 
-inline State::State(uint64_t threads, int64_t argc, char** argv) 
-	: verbose(false), epeeEnabled(true), format(State::RiposteFormat), done(0) {
+inline State::State(uint64_t threads, int64_t argc, char** argv, bool affinity, Placement placement) 
+	: verbose(false), epeeEnabled(true), epeeCompile(true), epeeMinLength(TRACE_VECTOR_WIDTH), epeeMaxLength(10000), epeeHysteresis(2), epeePrefetch(64), epeeDeterministic(false), random(0), format(State::RiposteFormat), perf(State::PerfNone), schedTrace(false), started(monotonic_time()), placement(placement), affinity(affinity), done(0) {
 	Environment* base = new Environment(1,0,0,Null::Singleton());
 	this->global = new Environment(1,base,0,Null::Singleton());
 	path.push_back(base);
@@ -375,13 +714,19 @@ inline State::State(uint64_t threads, int64_t argc, char** argv)
 	pthread_attr_setscope (&attr, PTHREAD_SCOPE_SYSTEM);
 	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
 
+	// before the threads start, they inherit the memory policy
+	place();
+
 	Thread* t = new Thread(*this, 0);
+	t->thread = pthread_self();
 	this->threads.push_back(t);
+	pin(*t);
 
 	for(uint64_t i = 1; i < threads; i++) {
 		Thread* t = new Thread(*this, i);
 		pthread_create (&t->thread, &attr, Thread::start, t);
 		this->threads.push_back(t);
+		pin(*t);
 	}
 
 	interpreter_init(getMainThread());
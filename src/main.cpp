@@ -179,6 +179,13 @@ static void usage()
     l_message(0,"    -f, --file         execute R script");
     l_message(0,"    -v, --verbose      enable verbose output");
     l_message(0,"    -j N               launch Riposte with N threads");
+    l_message(0,"    --perf=map|jitdump describe JIT'd traces to perf");
+    l_message(0,"    --trace-stats=FILE write per site trace telemetry to FILE as JSON at exit");
+    l_message(0,"    --sched-trace=FILE write each thread's scheduling timeline to FILE as a Chrome trace at exit");
+    l_message(0,"    --affinity         pin each thread to its own cpu");
+    l_message(0,"    --numa[=first-touch|interleave]");
+    l_message(0,"                       place big vectors' pages near the threads that use them,");
+    l_message(0,"                       or spread them over all the nodes");
 }
 
 extern int opterr;
@@ -196,6 +203,11 @@ int main(int argc, char** argv)
         { "script",    0,    NULL,    's' },
         { "args",      0,    NULL,    'a' },
         { "format",    1,    NULL,    'F' },
+        { "perf",      1,    NULL,    'P' },
+        { "trace-stats", 1,  NULL,    'T' },
+        { "sched-trace", 1,  NULL,    'S' },
+        { "affinity",  0,    NULL,    'A' },
+        { "numa",      2,    NULL,    'N' },
         { NULL,        0,    NULL,     0  }
     };
 
@@ -203,6 +215,11 @@ int main(int argc, char** argv)
     char * filename = NULL;
     bool echo = true;
     State::Format format = State::RiposteFormat;
+    State::PerfOutput perf = State::PerfNone;
+    char * statsname = NULL;
+    char * timelinename = NULL;
+    bool affinity = false;
+    State::Placement placement = State::PlaceNone;
     int threads = 1; 
 
     int ch;
@@ -237,6 +254,35 @@ int main(int argc, char** argv)
                 else
                     format = State::RiposteFormat;
                 break;
+            case 'P':
+                if(0 == strcmp("map",optarg))
+                    perf = State::PerfMap;
+                else if(0 == strcmp("jitdump",optarg))
+                    perf = State::PerfJitDump;
+                else {
+                    usage();
+                    exit(-1);
+                }
+                break;
+            case 'T':
+                statsname = optarg;
+                break;
+            case 'S':
+                timelinename = optarg;
+                break;
+            case 'A':
+                affinity = true;
+                break;
+            case 'N':
+                if(optarg == NULL || 0 == strcmp("first-touch",optarg))
+                    placement = State::PlaceFirstTouch;
+                else if(0 == strcmp("interleave",optarg))
+                    placement = State::PlaceInterleave;
+                else {
+                    usage();
+                    exit(-1);
+                }
+                break;
             case 'h':
             default:
                 usage();
@@ -248,9 +294,11 @@ int main(int argc, char** argv)
     d_message(1,NULL,"Command option processing complete");
 
     /* Initialize execution state */
-    State state(threads, argc, argv);
+    State state(threads, argc, argv, affinity, placement);
     state.verbose = verbose;
     state.format = format;
+    state.perf = perf;
+    state.schedTrace = timelinename != NULL;
     Thread& thread = state.getMainThread();
 
     /* Load built in & base functions */
@@ -278,6 +326,16 @@ int main(int argc, char** argv)
 
     /* Session over */
 
+    if(statsname != NULL) {
+        std::ofstream stats(statsname);
+        thread.traces.WriteStats(stats);
+    }
+
+    if(timelinename != NULL) {
+        std::ofstream timeline(timelinename);
+        state.writeTimeline(timeline);
+    }
+
     fflush(stdout);
     fflush(stderr);
 
@@ -73,6 +73,7 @@ template<class X> struct CountFold   { typedef X A; typedef X MA; typedef Intege
 template<class X> struct MomentFold { typedef X A; typedef Double MA; typedef Double R; };
 template<class X, class Y> struct Moment2Fold { 
     typedef X A; typedef Y B; typedef Double MA; typedef Double MB; typedef Double R; };
+template<class X> struct MomentsFold { typedef X A; typedef Double MA; typedef Double R; };
 
 
 // More complicated ops
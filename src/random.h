@@ -2,23 +2,40 @@
 #ifndef _RIPOSTE_RANDOM_H
 #define _RIPOSTE_RANDOM_H
 
-// A simple LCG random number generator that generates independent
-// streams for each thread.
+#include <stdint.h>
+#include <emmintrin.h>
+
+// A counter-based random number generator (Philox4x32-10, Salmon et al.
+// "Parallel random numbers: as easy as 1, 2, 3"). Element i of a random
+// vector only depends on the seed, the vector's stream, and i, so the
+// interpreter and the JIT produce the same values for any number of threads.
 
 struct Random {
-	static const uint64_t m = 0x27bb2ee687b0b0fd;
-	const uint64_t a;
-	uint64_t v;
+	uint64_t seed;
+	int64_t stream;		// every call to random() gets a new stream
+
+	Random(uint64_t seed) : seed(seed), stream(0) {}
 
-	static const int64_t primes[100];
-	
-	Random(uint64_t streamIndex) : a(primes[streamIndex]), v(1) {}
+	// elements 2*pair and 2*pair+1 of the given stream, uniform in [0,1)
+	static __m128d uniform(uint64_t seed, uint64_t stream, uint64_t pair) {
+		const __m128i m = _mm_set_epi32(0, 0xCD9E8D57, 0, 0xD2511F53);
+		const __m128i w = _mm_set_epi32(0, 0xBB67AE85, 0, 0x9E3779B9);
+		const __m128i even = _mm_set_epi32(0, -1, 0, -1);
 
-	uint64_t next() {
-		v = v * m + a;
-		return v;
+		__m128i c = _mm_set_epi64x(stream, pair);
+		__m128i k = _mm_set_epi32(0, (uint32_t)(seed >> 32), 0, (uint32_t)seed);
+		for(int r = 0; r < 10; r++) {
+			// (c0,c1,c2,c3) => (hi(M1*c2)^c1^k0, lo(M1*c2), hi(M0*c0)^c3^k1, lo(M0*c0))
+			__m128i p = _mm_shuffle_epi32(_mm_mul_epu32(c, m), _MM_SHUFFLE(0,1,2,3));
+			__m128i x = _mm_and_si128(_mm_shuffle_epi32(c, _MM_SHUFFLE(0,3,0,1)), even);
+			c = _mm_xor_si128(_mm_xor_si128(p, x), k);
+			k = _mm_add_epi32(k, w);
+		}
+
+		// top 52 bits as the mantissa of a double in [1,2)
+		__m128i d = _mm_or_si128(_mm_srli_epi64(c, 12), _mm_set1_epi64x(0x3FF0000000000000LL));
+		return _mm_sub_pd(_mm_castsi128_pd(d), _mm_set1_pd(1.0));
 	}
 };
 
 #endif
-
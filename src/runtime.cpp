@@ -171,6 +171,51 @@ struct SubsetIndexed {
 	}
 };*/
 
+// f holds 0-based group numbers, elements in no group are dropped like they are in a trace
+List SplitSlow(Thread& thread, Value const& a, Integer const& f, int64_t levels) {
+	int64_t length = ((Vector const&)a).length();
+	if(f.length() == 0 && length > 0)
+		_error("split factor is of zero length");
+	std::vector<int64_t> counts(levels, 0);
+	for(int64_t i = 0; i < length; i++) {
+		int64_t g = f[i % f.length()];
+		if(!Integer::isNA(g) && g >= 0 && g < levels) counts[g]++;
+	}
+	std::vector<Integer> indices;
+	for(int64_t g = 0; g < levels; g++)
+		indices.push_back(Integer(counts[g]));
+	std::fill(counts.begin(), counts.end(), 0);
+	for(int64_t i = 0; i < length; i++) {
+		int64_t g = f[i % f.length()];
+		if(!Integer::isNA(g) && g >= 0 && g < levels) indices[g][counts[g]++] = i+1;
+	}
+	List r(levels);
+	for(int64_t g = 0; g < levels; g++)
+		SubsetSlow(thread, a, indices[g], r[g]);
+	return r;
+}
+
+void Unsplit(Thread& thread, List const& groups, Value& out) {
+	if(groups.length() == 0) {
+		out = Null::Singleton();
+		return;
+	}
+	int64_t length = 0;
+	for(int64_t g = 0; g < groups.length(); g++)
+		length += ((Vector const&)groups[g]).length();
+	switch(groups[0].type()) {
+		#define CASE(Name) case Type::Name: out = Name(length); break;
+		VECTOR_TYPES_NOT_NULL(CASE)
+		#undef CASE
+		default: _error(std::string("NYI: Unsplit of ") + Type::toString(groups[0].type())); break;
+	};
+	for(int64_t g = 0, i = 0; g < groups.length(); g++) {
+		int64_t n = ((Vector const&)groups[g]).length();
+		Insert(thread, groups[g], 0, out, i, n);
+		i += n;
+	}
+}
+
 void SubsetSlow(Thread& thread, Value const& a, Value const& i, Value& out) {
 	if(i.isDouble() || i.isInteger()) {
 		Integer index = As<Integer>(thread, i);
@@ -48,6 +48,10 @@ inline void Element2(Value const& v, int64_t index, Value& out) {
 
 void SubsetSlow(Thread& thread, Value const& a, Value const& i, Value& out); 
 
+// the groups of a split that isn't traced, and the folds of them joined back into one vector
+List SplitSlow(Thread& thread, Value const& a, Integer const& f, int64_t levels);
+void Unsplit(Thread& thread, List const& groups, Value& out);
+
 inline void Subset(Thread& thread, Value const& a, Value const& i, Value& out) {
 	if(i.isDouble1() && i.d >= 1) {
 		Element(a, (int64_t)i.d-1, out);
@@ -208,7 +212,7 @@ inline Integer Repeat(Integer const& each, int64_t const length) {
 	return r;
 }
 
-Double RandomVector(Thread& thread, int64_t const length);
+Double RandomVector(Thread& thread, int64_t const length, int64_t const stream);
 
 #endif
 
@@ -1,4 +1,5 @@
 #include "strings.h"
+#include "interpreter.h"
 
 #define DEFINE(name, string, ...) String Strings::name = string;
 STRINGS(DEFINE)
@@ -6,3 +7,103 @@ STRINGS(DEFINE)
 
 String Strings::pos = Strings::add;
 String Strings::neg = Strings::sub;
+
+StringTable::StringTable() {
+	for(uint64_t i = 0; i < SHARDS; i++) {
+		Shard& shard = shards[i];
+		shard.size = 64;
+		shard.count = 0;
+		shard.slots = new Slot[shard.size]();
+		shard.arena = shard.end = 0;
+	}
+	// the built in strings are interned as they are, a later duplicate wins
+	#define ENUM_STRING_TABLE(name, string) put(Strings::name);
+	STRINGS(ENUM_STRING_TABLE);
+	#undef ENUM_STRING_TABLE
+}
+
+void StringTable::put(String s) {
+	size_t n = strlen(s);
+	uint64_t h = hash(s, n);
+	Shard& shard = shardOf(h);
+	Slot& slot = find(shard, h, s, n);
+	bool added = slot.s == 0;
+	slot.hash = h;
+	slot.s = s;
+	if(added && ++shard.count*2 > shard.size)
+		grow(shard);
+}
+
+// FNV-1a, with a final mix so the top bits, which pick the shard, depend on every byte
+uint64_t StringTable::hash(char const* s, size_t n) {
+	uint64_t h = 14695981039346656037ULL;
+	for(size_t i = 0; i < n; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// The slot holding s, or the empty one it'd go in.
+StringTable::Slot& StringTable::find(Shard& shard, uint64_t h, char const* s, size_t n) {
+	uint64_t mask = shard.size - 1;
+	for(uint64_t i = h & mask; ; i = (i+1) & mask) {
+		Slot& slot = shard.slots[i];
+		if(slot.s == 0 || (slot.hash == h && memcmp(slot.s, s, n) == 0 && slot.s[n] == 0))
+			return slot;
+	}
+}
+
+char* StringTable::copy(Shard& shard, char const* s, size_t n) {
+	char* r;
+	if(n+1 > ARENA/4)
+		r = new char[n+1];
+	else {
+		if(shard.arena+n+1 > shard.end) {
+			shard.arena = new char[ARENA];
+			shard.end = shard.arena + ARENA;
+		}
+		r = shard.arena;
+		shard.arena += n+1;
+	}
+	memcpy(r, s, n);
+	r[n] = 0;
+	return r;
+}
+
+void StringTable::grow(Shard& shard) {
+	Slot* old = shard.slots;
+	uint64_t size = shard.size;
+	shard.size *= 2;
+	shard.slots = new Slot[shard.size]();
+	uint64_t mask = shard.size - 1;
+	for(uint64_t i = 0; i < size; i++) {
+		if(old[i].s == 0)
+			continue;
+		uint64_t j = old[i].hash & mask;
+		while(shard.slots[j].s != 0)
+			j = (j+1) & mask;
+		shard.slots[j] = old[i];
+	}
+	delete [] old;
+}
+
+String StringTable::in(char const* s, size_t n) {
+	uint64_t h = hash(s, n);
+	Shard& shard = shardOf(h);
+	shard.lock.acquire();
+	Slot& slot = find(shard, h, s, n);
+	String r = slot.s;
+	if(r == 0) {
+		r = copy(shard, s, n);
+		slot.hash = h;
+		slot.s = r;
+		if(++shard.count*2 > shard.size)
+			grow(shard);
+	}
+	shard.lock.release();
+	return r;
+}
@@ -101,6 +101,7 @@
 	_(prod,		"prod") \
 	_(mean,		"mean") \
 	_(cm2,		"cm2") \
+	_(moments,	"moments") \
 	_(min,		"min") \
 	_(max,		"max") \
 	_(pmin,		"pmin") \
@@ -4,6 +4,14 @@
 
 #include <pthread.h>
 #include <time.h>
+#include <limits.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 static inline int fetch_and_add(int64_t * variable, int64_t value) {
 	asm volatile( 
@@ -42,6 +50,118 @@ public:
     }
 };
 
+static inline bool compare_and_swap(int64_t volatile* variable, int64_t expected, int64_t value) {
+	return __sync_bool_compare_and_swap(variable, expected, value);
+}
+
+// keeps the compiler from moving loads and stores across it, x86 doesn't reorder them otherwise
+static inline void compiler_barrier() {
+	asm volatile("" ::: "memory");
+}
+
+// Chase-Lev work-stealing deque (with the fences Le et al. give for x86).
+// Only the owner pushes and pops, at the bottom, without taking a lock.
+// Other threads steal from the top with a single compare and swap.
+// Arrays that are outgrown are kept until the deque is destroyed, since a thief may still be reading one.
+template<class T>
+class WorkDeque
+{
+	struct Array {
+		int64_t size;
+		T* items;
+		Array* previous;
+		Array(int64_t size, Array* previous) : size(size), items(new T[size]), previous(previous) {}
+		~Array() { delete [] items; }
+		T& operator[](int64_t i) { return items[i & (size-1)]; }
+	};
+
+	int64_t volatile top;
+	char padding[64];	// thieves write top, keep it off the owner's line
+	int64_t volatile bottom;
+	Array* volatile array;
+
+	Array* grow(Array* a, int64_t t, int64_t b) {
+		Array* n = new Array(a->size*2, a);
+		for(int64_t i = t; i < b; i++)
+			(*n)[i] = (*a)[i];
+		compiler_barrier();	// the copies land before a thief can see the new array
+		array = n;
+		return n;
+	}
+
+public:
+	WorkDeque() : top(0), bottom(0), array(new Array(64, 0)) {}
+
+	~WorkDeque() {
+		for(Array* a = array; a != 0; ) {
+			Array* p = a->previous;
+			delete a;
+			a = p;
+		}
+	}
+
+	void push(T const& item) {
+		int64_t b = bottom;
+		int64_t t = top;
+		Array* a = array;
+		if(b - t >= a->size)
+			a = grow(a, t, b);
+		(*a)[b] = item;
+		compiler_barrier();
+		bottom = b+1;
+	}
+
+	bool pop(T& out) {
+		int64_t b = bottom-1;
+		Array* a = array;
+		bottom = b;
+		__sync_synchronize();	// the store to bottom has to be seen before we read top
+		int64_t t = top;
+		if(t > b) {
+			bottom = b+1;
+			return false;
+		}
+		out = (*a)[b];
+		if(t == b) {
+			// the last item, race the thieves for it
+			bool won = compare_and_swap(&top, t, t+1);
+			bottom = b+1;
+			return won;
+		}
+		return true;
+	}
+
+	bool steal(T& out) {
+		int64_t t = top;
+		compiler_barrier();
+		int64_t b = bottom;
+		if(t >= b)
+			return false;
+		Array* a = array;
+		out = (*a)[t];
+		compiler_barrier();
+		return compare_and_swap(&top, t, t+1);
+	}
+
+	// only takes the top item if accept(item) says so
+	template<class Accept>
+	bool steal(T& out, Accept const& accept) {
+		int64_t t = top;
+		compiler_barrier();
+		int64_t b = bottom;
+		if(t >= b)
+			return false;
+		Array* a = array;
+		out = (*a)[t];
+		compiler_barrier();
+		return accept(out) && compare_and_swap(&top, t, t+1);
+	}
+
+	bool empty() const {
+		return bottom <= top;
+	}
+};
+
 static inline void sleep() {
 	struct timespec sleepTime;
 	struct timespec returnTime;
@@ -50,4 +170,46 @@ static inline void sleep() {
 	nanosleep(&sleepTime, &returnTime);
 }
 
+static inline void cpu_relax() {
+	asm volatile("pause" ::: "memory");
+}
+
+// Lets idle threads block in the kernel until something they may be waiting for happens.
+// A waiter takes a key, checks its condition once more and then waits on the key,
+// so a notify that lands between the check and the wait isn't lost.
+class EventCount
+{
+	int32_t volatile epoch;
+	int32_t volatile waiters;
+public:
+	EventCount() : epoch(0), waiters(0) {}
+
+	int32_t prepare() {
+		__sync_fetch_and_add(&waiters, 1);
+		return epoch;
+	}
+
+	void cancel() {
+		__sync_fetch_and_sub(&waiters, 1);
+	}
+
+	void wait(int32_t key) {
+#ifdef __linux__
+		syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, key, 0, 0, 0);
+#else
+		if(epoch == key) sleep();
+#endif
+		__sync_fetch_and_sub(&waiters, 1);
+	}
+
+	// wakes every waiter, or with count, only that many
+	void notify(int32_t count = INT_MAX) {
+		__sync_fetch_and_add(&epoch, 1);
+#ifdef __linux__
+		if(waiters > 0)
+			syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, count, 0, 0, 0);
+#endif
+	}
+};
+
 #endif
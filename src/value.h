@@ -12,7 +12,7 @@
 #include "strings.h"
 #include "exceptions.h"
 
-typedef int16_t IRef;
+typedef int32_t IRef;
 
 struct Value {
 	
@@ -187,14 +187,18 @@ struct REnvironment : public Object {
 
 struct Future : public Object {
 	static const Type::Enum ValueType = Type::Future;
+	// traces are 8 byte aligned with 47 bit addresses, which leaves 20 bits for the ref
+	static const int REF_BITS = 20;
+
 	static Future& Init(Value& f, Trace* trace, IRef ref) {
+		assert(ref >= 0 && ref < (1 << REF_BITS));
 		Value::Init(f,Type::Future,0);
-		f.i = (((uint64_t)trace) << 16) + ref;
+		f.i = (((uint64_t)trace) << (REF_BITS-3)) + ref;
 		return (Future&)f;
 	}
 
-	Trace* trace() const { return (Trace*)(((uint64_t)i)>>16); }
-	IRef ref() const { return (IRef)(uint64_t)i; }
+	Trace* trace() const { return (Trace*)((((uint64_t)i) >> REF_BITS) << 3); }
+	IRef ref() const { return (IRef)(((uint64_t)i) & ((1 << REF_BITS)-1)); }
 };
 
 struct Function : public Object {